@@ -0,0 +1,328 @@
+//NeoPixel based lap counter for CrossMgr, driving a panel for every group from one controller
+//This was written for WS2812B LEDs and an ESP32 dev board; FastLED drives each strip from its own RMT channel, so the strips refresh in parallel
+//Digits use the same 91-pixel layout as NeoPixelLapCounter.ino, see drawDigit() there for details
+
+#define DEBUG
+#define DEBUG_RENDER  //report how long it takes to compose and show a frame
+
+#include <WiFi.h>   //wireless networking
+#include <CrossMgrLapCounter.h> //lapcounter API
+
+//select serial device
+#define DEBUG_SERIAL Serial
+
+//debugging mode
+#if defined (DEBUG) || defined (DEBUG_ESP_PORT)
+#define DEBUG_PRINT(...) DEBUG_SERIAL.print( __VA_ARGS__ )
+#else
+#define DEBUG_PRINT(...)
+#endif
+
+//network config
+#define CROSSMGR_IP 192,168,1,15  //for websocket to connect to (note commas!)
+#define WEBSOCKET_RECONNECT_INTERVAL 15000 //milliseconds
+const char * _wifi_ssid = "BHPC_Timing"; // your network SSID (name)
+const char * _wifi_pass = "";  // your network password
+
+//display settings
+#define LED_REFRESH_INTERVAL 500 //milliseconds, for flashing and lap clocks; lap changes are drawn as soon as they arrive
+#define LED_BRIGHTNESS 128  //0-255
+#define RENDER_REPORT_INTERVAL 10000  //milliseconds
+
+//LED strips, one data pin each
+#define NUM_STRIPS 3
+#define STRIP_0_PIN 16
+#define STRIP_1_PIN 17
+#define STRIP_2_PIN 18
+#define LEDS_PER_STRIP 364
+#define DIGIT_LENGTH 91  //pixels in one digit
+#define MAX_GROUPS 6  //CrossMgr sends this many lap counters
+
+/* The display layout.  Each panel is a row of digits somewhere on one of the strips, showing one CrossMgr group.
+ * Digit 0 is the least significant (rightmost) digit, and is at the offset given; further digits follow it along the strip.
+ * If lap_clock is set, the panel shows the group's lap elapsed time instead of laps whenever CrossMgr's "Show Lap Elapsed Time" is enabled.
+ */
+typedef struct {
+  int strip;          //which strip the panel is on
+  int offset;         //first pixel of the panel on that strip
+  int digits;         //number of digits
+  int group;          //CrossMgr lap counter to follow, first counter is 0
+  boolean lap_clock;  //show the lap elapsed clock when CrossMgr asks for it
+} PanelLayout;
+
+const PanelLayout _layout[] = {
+  //strip, offset, digits, group, lap_clock
+  {0, 0,                  2, 0, false},
+  {0, 2 * DIGIT_LENGTH,   2, 1, false},
+  {1, 0,                  2, 2, false},
+  {1, 2 * DIGIT_LENGTH,   2, 3, false},
+  {2, 0,                  2, 4, false},
+  {2, 2 * DIGIT_LENGTH,   2, 5, false},
+};
+#define NUM_PANELS (int)(sizeof(_layout) / sizeof(_layout[0]))
+
+//a panel after its layout has been checked and resolved to a position in the LED arrays
+typedef struct {
+  const PanelLayout * layout;
+  CRGB * leds;     //first pixel of the panel, null if the layout was invalid
+  boolean dirty;   //needs redrawing
+  boolean animated;  //flashing or showing a clock, so redrawn every LED_REFRESH_INTERVAL
+} Panel;
+
+/* Glyphs as bitmasks, one bit per pixel of a digit, least significant bit first.
+ * These are the output of drawDigit() in NeoPixelLapCounter.ino, so they keep its hand-tuned 'serifs',
+ * but a digit can be drawn with a single pass over 91 bits instead of a switch and a dozen loops.
+ */
+#define GLYPH_n 10
+#define GLYPH_o 11
+const uint32_t _glyphs[][3] PROGMEM = {
+  {0xEFFFFFFE, 0xFFFFFEFF, 0x0000FFEF},  //0
+  {0x1FFFFFFF, 0x00000000, 0x00000000},  //1
+  {0xEFFF8001, 0xFF8002FF, 0x07FFFFFF},  //2
+  {0xEFFFBFFE, 0x000002FF, 0x07FFFFE8},  //3
+  {0x1FFFFFFF, 0x003FFF00, 0x07FF0000},  //4
+  {0xF0003FFE, 0x003FFFFF, 0x07FFFFE8},  //5
+  {0xE0003FFE, 0xFFFFFEFF, 0x07FFFFEF},  //6
+  {0xFFFFFFFF, 0x000000FF, 0x00000000},  //7
+  {0xEFFFBFFE, 0xFFBFFEFF, 0x07FFFFEF},  //8
+  {0xEFFFFFFE, 0x003FFEFF, 0x07FFFFE8},  //9
+  {0x00003FFE, 0xFF800000, 0x07FF000F},  //n
+  {0x00003FFE, 0xFF800000, 0x07FFFFEF},  //o
+};
+
+CRGB leds[NUM_STRIPS][LEDS_PER_STRIP];
+Panel _panels[NUM_PANELS];
+IPAddress _crossmgr_ip;
+unsigned long _last_LED_refresh = 0;
+unsigned long _last_render_report = 0;
+unsigned long _max_compose_time = 0;
+unsigned long _max_show_time = 0;
+unsigned long _frames_shown = 0;
+
+void setup() {
+  DEBUG_SERIAL.begin(115200);
+  DEBUG_SERIAL.println("\r\n");
+  DEBUG_SERIAL.flush();
+  delay(100);
+  DEBUG_SERIAL.print(F("\r\n\r\nCrossMgr multi-panel lap counter\r\n"));
+
+  //initialise FastLED and clear the strips
+  DEBUG_PRINT(F("[LED] Initialising LED strips...\r\n"));
+  FastLED.addLeds<NEOPIXEL, STRIP_0_PIN>(leds[0], LEDS_PER_STRIP);  // GRB ordering is assumed
+  #if NUM_STRIPS > 1
+  FastLED.addLeds<NEOPIXEL, STRIP_1_PIN>(leds[1], LEDS_PER_STRIP);
+  #endif
+  #if NUM_STRIPS > 2
+  FastLED.addLeds<NEOPIXEL, STRIP_2_PIN>(leds[2], LEDS_PER_STRIP);
+  #endif
+  FastLED.setBrightness(LED_BRIGHTNESS);
+  for (int s = 0; s < NUM_STRIPS; s++) {
+    fill_solid(leds[s], LEDS_PER_STRIP, CRGB::Black);
+  }
+  FastLED.show();
+  compileLayout();
+
+  //connect to WiFi
+  DEBUG_PRINT(F("[Net] Connecting to "));
+  DEBUG_PRINT(_wifi_ssid);
+  WiFi.mode(WIFI_STA);
+  WiFi.begin(_wifi_ssid, _wifi_pass);
+  while (WiFi.status() != WL_CONNECTED) {
+    delay(500);
+    DEBUG_PRINT(".");
+  }
+  DEBUG_PRINT(F("\r\n[Net] Connected, my IP is "));
+  DEBUG_PRINT(WiFi.localIP());
+  DEBUG_PRINT(F("\r\n"));
+
+  //set up the connection to CrossMgr
+  _crossmgr_ip = IPAddress(CROSSMGR_IP);
+  crossMgrSetup(_crossmgr_ip, WEBSOCKET_RECONNECT_INTERVAL);
+  #ifdef DEBUG
+  crossMgrSetDebug(onCmrDebug);
+  #endif
+  //each panel only hears about its own group, so a lap change in one category doesn't redraw the others
+  for (int i = 0; i < NUM_PANELS; i++) {
+    if (_panels[i].leds) {
+      crossMgrSubscribe(CROSSMGR_EVENT_RACE_DATA, onPanelData, &_panels[i], _panels[i].layout->group);
+      crossMgrSubscribe(CROSSMGR_EVENT_COLOURS, onPanelData, &_panels[i], _panels[i].layout->group);
+    }
+  }
+  crossMgrSubscribe(CROSSMGR_EVENT_NETWORK, onNetwork, nullptr);  //the laps are cleared on disconnect, so every panel needs redrawing
+  DEBUG_PRINT(F("[Sys] Startup complete.\r\n\r\n"));
+}
+
+#ifdef DEBUG
+void onCmrDebug(const char * line) {  //print debugging output to serial
+  DEBUG_PRINT(line);
+}
+#endif
+
+void onPanelData(const CrossMgrEvent * event, void * context) {  //called when this panel's group changes
+  Panel * panel = (Panel *)context;
+  panel->dirty = true;
+}
+
+void onNetwork(const CrossMgrEvent * event, void * context) {  //called when the connection changes
+  for (int i = 0; i < NUM_PANELS; i++) {
+    _panels[i].dirty = true;
+  }
+}
+
+/* Checks the layout and works out where each panel's pixels are.
+ * Panels that don't fit on their strip, or overlap an earlier panel, are disabled.
+ */
+void compileLayout() {
+  for (int i = 0; i < NUM_PANELS; i++) {
+    const PanelLayout * l = &_layout[i];
+    _panels[i].layout = l;
+    _panels[i].leds = nullptr;
+    _panels[i].dirty = true;
+    _panels[i].animated = false;
+    int end = l->offset + l->digits * DIGIT_LENGTH;
+    if (l->strip < 0 || l->strip >= NUM_STRIPS || l->offset < 0 || l->digits < 1 || end > LEDS_PER_STRIP) {
+      DEBUG_PRINT(F("[Err] Panel "));
+      DEBUG_PRINT(i);
+      DEBUG_PRINT(F(" does not fit on its strip!\r\n"));
+      continue;
+    }
+    if (l->group < 0 || l->group >= MAX_GROUPS) {
+      DEBUG_PRINT(F("[Err] Panel "));
+      DEBUG_PRINT(i);
+      DEBUG_PRINT(F(" has an invalid group!\r\n"));
+      continue;
+    }
+    boolean overlaps = false;
+    for (int j = 0; j < i; j++) {
+      const PanelLayout * o = &_layout[j];
+      if (_panels[j].leds && o->strip == l->strip && l->offset < o->offset + o->digits * DIGIT_LENGTH && o->offset < end) {
+        overlaps = true;
+      }
+    }
+    if (overlaps) {
+      DEBUG_PRINT(F("[Err] Panel "));
+      DEBUG_PRINT(i);
+      DEBUG_PRINT(F(" overlaps another panel!\r\n"));
+      continue;
+    }
+    _panels[i].leds = &leds[l->strip][l->offset];
+    DEBUG_PRINT(F("[LED] Panel "));
+    DEBUG_PRINT(i);
+    DEBUG_PRINT(F(": group "));
+    DEBUG_PRINT(l->group);
+    DEBUG_PRINT(F(" on strip "));
+    DEBUG_PRINT(l->strip);
+    DEBUG_PRINT(F(" @ "));
+    DEBUG_PRINT(l->offset);
+    DEBUG_PRINT(F("\r\n"));
+  }
+}
+
+void loop() {
+  boolean refresh = false;
+  if (millis() - _last_LED_refresh >= LED_REFRESH_INTERVAL) {
+    _last_LED_refresh = millis();
+    refresh = true;
+  }
+  //compose any panels that have changed
+  unsigned long compose_start = micros();
+  boolean any_dirty = false;
+  for (int i = 0; i < NUM_PANELS; i++) {
+    Panel * panel = &_panels[i];
+    if (panel->leds && (panel->dirty || (refresh && panel->animated))) {
+      composePanel(panel);
+      panel->dirty = false;
+      any_dirty = true;
+    }
+  }
+  if (any_dirty) {
+    #ifdef ENABLE_LATENCY_TRACE
+    crossMgrTraceRendered();  //for latency measurement
+    #endif
+    unsigned long show_start = micros();
+    _max_compose_time = max(_max_compose_time, show_start - compose_start);
+    FastLED.show();  //all strips are sent at once
+    #ifdef ENABLE_LATENCY_TRACE
+    crossMgrTraceShown();
+    #endif
+    _max_show_time = max(_max_show_time, micros() - show_start);
+    _frames_shown++;
+  }
+  #ifdef DEBUG_RENDER
+  if (millis() - _last_render_report >= RENDER_REPORT_INTERVAL) {
+    _last_render_report = millis();
+    char buf[100];
+    snprintf_P(buf, sizeof(buf), PSTR("[LED] %lu frames, worst case compose %lu us, show %lu us\r\n"), _frames_shown, _max_compose_time, _max_show_time);
+    DEBUG_PRINT(buf);
+    _frames_shown = 0;
+    _max_compose_time = 0;
+    _max_show_time = 0;
+    #ifdef ENABLE_LATENCY_TRACE
+    crossMgrTraceReport();
+    #endif
+  }
+  #endif
+  //call this regularly...
+  crossMgrLoop();
+}
+
+void composePanel(Panel * panel) {
+  const PanelLayout * l = panel->layout;
+  fill_solid(panel->leds, l->digits * DIGIT_LENGTH, CRGB::Black);
+  panel->animated = false;
+  if (!crossMgrRaceInProgress()) {
+    //write "no" in red
+    if (l->digits >= 2) {
+      drawGlyph(panel->leds + DIGIT_LENGTH, GLYPH_n, CRGB::Red);
+    }
+    drawGlyph(panel->leds, GLYPH_o, CRGB::Red);
+    return;
+  }
+  //calculate what colour to use
+  CRGB c = crossMgrGetFGColour(l->group);
+  if (crossMgrFlashLaps(l->group)) {
+    panel->animated = true;
+    if ((millis()/LED_REFRESH_INTERVAL)%2 > 0) {
+      //dark state of flash
+      c.nscale8_video(64);
+    }
+  }
+  if (l->lap_clock && crossMgrWantsLapClock()) {
+    //minutes and seconds if there's room, otherwise just seconds
+    panel->animated = true;
+    unsigned long elapsed = crossMgrLapElapsed(l->group) / 1000;
+    if (l->digits >= 4) {
+      drawNumber(panel->leds, 2, elapsed % 60, c, true);
+      drawNumber(panel->leds + 2 * DIGIT_LENGTH, l->digits - 2, elapsed / 60, c, false);
+    } else {
+      drawNumber(panel->leds, l->digits, elapsed, c, false);
+    }
+  } else {
+    drawNumber(panel->leds, l->digits, crossMgrLaps(l->group), c, false);
+  }
+}
+
+void drawNumber(CRGB * digit_leds, int digits, unsigned long value, CRGB colour, boolean leading_zeros) {
+  //least significant digit first, blanking leading zeros unless asked not to
+  for (int d = 0; d < digits; d++) {
+    if (d > 0 && value == 0 && !leading_zeros) {
+      break;
+    }
+    drawGlyph(digit_leds + d * DIGIT_LENGTH, value % 10, colour);
+    value /= 10;
+  }
+}
+
+void drawGlyph(CRGB * digit_leds, int glyph, CRGB colour) {
+  for (int w = 0; w < 3; w++) {
+    uint32_t mask = pgm_read_dword(&_glyphs[glyph][w]);
+    CRGB * p = digit_leds + w * 32;
+    while (mask) {
+      if (mask & 1) {
+        *p = colour;
+      }
+      mask >>= 1;
+      p++;
+    }
+  }
+}
@@ -39,6 +39,10 @@
 #define NETWORK_LED_TIMEOUT 300  //milliseconds
 #define LED_REFRESH_INTERVAL 500 //milliseconds
 #define USE_HEARTBEAT  //if set, draws a 'heartbeat' on the last pixel, for checking the LED strip continuity
+#define LATENCY_REPORT_INTERVAL 60000  //milliseconds, how often to print latency percentiles when debugging
+#ifdef ENABLE_CHECKPOINT
+#define CHECKPOINT_INTERVAL 5000  //milliseconds, how often the race state may be saved to flash (it is only written if it has changed)
+#endif
 
 //brightness settings
 #define LIGHT_SENSOR_READ_INTERVAL 5123  // milliseconds
@@ -89,6 +93,7 @@ CRGB leds[NUM_LEDS];
 unsigned long _last_light_sensor_poll = 0;
 unsigned long _network_LED_time = 0;
 unsigned long _last_LED_refresh = 0;
+unsigned long _last_latency_report = 0;
 int _brightness = LED_MIN_BRIGHTNESS;
 boolean _full_brightness = false;
 
@@ -131,6 +136,24 @@ void setup() {
   fill_solid(&(leds[0]), NUM_LEDS, CRGB::Black);
   FastLED.show();
 
+  //set up the connection to CrossMgr
+  //this is done before WiFi is up, so that the last known lap count can be restored from flash and shown straight away
+  crossMgrIP=IPAddress(CROSSMGR_IP);
+  DEBUG_PRINT(F("\n[CMr] Using "));
+  DEBUG_PRINT(crossMgrIP);
+  DEBUG_PRINT(F(" for server IP address.\r\n"));
+  crossMgrSetup(crossMgrIP, WEBSOCKET_RECONNECT_INTERVAL);
+  crossMgrSetOnNetwork(onNetwork);
+  #ifdef DEBUG
+  crossMgrSetDebug(onCmrDebug);
+  #endif
+  #ifdef ENABLE_CHECKPOINT
+  if (crossMgrEnableCheckpoint(CHECKPOINT_INTERVAL)) {
+    DEBUG_PRINT(F("[CMr] Restored last known race state\r\n"));
+  }
+  #endif
+  refreshDisplay();
+
   //station mode
   //set physical mode to 802.11b for increased range
   WiFi.setPhyMode(WIFI_PHY_MODE_11B);
@@ -153,7 +176,7 @@ void setup() {
     updateWiFiLED();
     delay(500);
     DEBUG_PRINT(".");
-    FastLED.show();  //to clear glitch on display
+    refreshDisplay();  //also clears glitch on display
     if (wifiMulti.run(WIFI_CONNECT_TIMEOUT) == WL_CONNECTED) {
       DEBUG_PRINT(F("\n[Net] Connected to "));
       DEBUG_PRINT(WiFi.SSID());
@@ -217,17 +240,6 @@ void setup() {
   ArduinoOTA.begin();
   #endif
 
-  //set up the connection to CrossMgr
-  crossMgrIP=IPAddress(CROSSMGR_IP);
-  DEBUG_PRINT(F("\n[CMr] Using "));
-  DEBUG_PRINT(crossMgrIP);
-  DEBUG_PRINT(F(" for server IP address.\r\n"));
-  crossMgrSetup(crossMgrIP, WEBSOCKET_RECONNECT_INTERVAL);
-  crossMgrSetOnNetwork(onNetwork);
-  #ifdef DEBUG
-  crossMgrSetDebug(onCmrDebug);
-  #endif
-  
   DEBUG_PRINT(F("\n[Sys] Startup complete.\r\n\r\n"));
 }
 
@@ -249,46 +261,17 @@ void onCmrDebug(const char * line) {  //print debugging output to serial
 void loop() {
   if (millis() - _last_LED_refresh >= LED_REFRESH_INTERVAL) {  //refresh main LED display
     _last_LED_refresh = millis();
-    if (crossMgrRaceInProgress()) {
-      //calculate what colour to use
-      CRGB c;
-      if (!(crossMgrFlashLaps(CROSSMGR_LAPCOUNTER_GROUP) && (millis()/LED_REFRESH_INTERVAL)%2 > 0)) {
-        //normal brightness / light state of flash
-        c = crossMgrGetFGColour(CROSSMGR_LAPCOUNTER_GROUP);
-      } else if (crossMgrFlashLaps(CROSSMGR_LAPCOUNTER_GROUP)) {
-        //dark state of flash
-        c = crossMgrGetFGColour(CROSSMGR_LAPCOUNTER_GROUP);
-        // Reduce color to 75% (192/256ths) of its previous value
-        // using "video" scaling, meaning: never fading to full black
-        c.nscale8_video(64);
-      }
-      //clear the display
-      fill_solid(&(leds[0]), NUM_LEDS, CRGB::Black);
-      //draw the least significant digit
-      int laps = crossMgrLaps(CROSSMGR_LAPCOUNTER_GROUP);
-      int digit = laps%10;
-      drawDigit(DIGIT_0, digit, c);
-      //now draw the tens
-      if (laps >=10) {
-        digit = (laps/10)%10;
-        drawDigit(DIGIT_1, digit, c);
-      }
-    } else {  //no race in progress
-      //clear the display
-      fill_solid(&(leds[0]), NUM_LEDS, CRGB::Black);
-      //write "no" in red
-      CRGB c = CRGB::Red;
-      drawDigit(DIGIT_1, CHARACTER_n, c);
-      drawDigit(DIGIT_0, CHARACTER_o, c);
-    } 
-    #ifdef USE_HEARTBEAT
-    if ((millis()/LED_REFRESH_INTERVAL)%2 > 0) {  //draw a heartbeat on the last LED to show the strip is working
-      leds[HEARTBEAT_LED] = CRGB::DarkRed;    
-    }
+    refreshDisplay();
+  }
+  #ifdef DEBUG
+  if (millis() - _last_latency_report >= LATENCY_REPORT_INTERVAL) {
+    _last_latency_report = millis();
+    #ifdef ENABLE_LATENCY_TRACE
+    crossMgrTraceReport();
     #endif
-    //finally, update the LED strip
-    FastLED.show();
+    crossMgrFrameStatsReport();
   }
+  #endif
   //call these regularly...
   crossMgrLoop();
   wifiMulti.run(WIFI_CONNECT_TIMEOUT);
@@ -302,6 +285,54 @@ void loop() {
 }
 
 
+void refreshDisplay() {
+  if (crossMgrRaceInProgress()) {
+    //calculate what colour to use
+    CRGB c;
+    if (!(crossMgrFlashLaps(CROSSMGR_LAPCOUNTER_GROUP) && (millis()/LED_REFRESH_INTERVAL)%2 > 0)) {
+      //normal brightness / light state of flash
+      c = crossMgrGetFGColour(CROSSMGR_LAPCOUNTER_GROUP);
+    } else if (crossMgrFlashLaps(CROSSMGR_LAPCOUNTER_GROUP)) {
+      //dark state of flash
+      c = crossMgrGetFGColour(CROSSMGR_LAPCOUNTER_GROUP);
+      // Reduce color to 75% (192/256ths) of its previous value
+      // using "video" scaling, meaning: never fading to full black
+      c.nscale8_video(64);
+    }
+    //clear the display
+    fill_solid(&(leds[0]), NUM_LEDS, CRGB::Black);
+    //draw the least significant digit
+    int laps = crossMgrLaps(CROSSMGR_LAPCOUNTER_GROUP);
+    int digit = laps%10;
+    drawDigit(DIGIT_0, digit, c);
+    //now draw the tens
+    if (laps >=10) {
+      digit = (laps/10)%10;
+      drawDigit(DIGIT_1, digit, c);
+    }
+  } else {  //no race in progress
+    //clear the display
+    fill_solid(&(leds[0]), NUM_LEDS, CRGB::Black);
+    //write "no" in red
+    CRGB c = CRGB::Red;
+    drawDigit(DIGIT_1, CHARACTER_n, c);
+    drawDigit(DIGIT_0, CHARACTER_o, c);
+  } 
+  #ifdef ENABLE_LATENCY_TRACE
+  crossMgrTraceRendered();  //for latency measurement
+  #endif
+  #ifdef USE_HEARTBEAT
+  if ((millis()/LED_REFRESH_INTERVAL)%2 > 0) {  //draw a heartbeat on the last LED to show the strip is working
+    leds[HEARTBEAT_LED] = CRGB::DarkRed;    
+  }
+  #endif
+  //finally, update the LED strip
+  FastLED.show();
+  #ifdef ENABLE_LATENCY_TRACE
+  crossMgrTraceShown();
+  #endif
+}
+
 /* Uses FastLED's setBrightness() function to dim the display in response to ambient light
  * connect a TEPT4400 between the LIGHT_SENSOR pin and 3.3V, and 
  * a 6k resistor between the LIGHT_SENSOR pin and ground.
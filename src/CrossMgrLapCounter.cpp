@@ -1,5 +1,6 @@
 #define CROSSMGR_LAP_COUNTER_VERSION 20231004.1
 #include "CrossMgrLapCounter.h"
+#include <limits.h>
 
 #define RACE_TIMEOUT 60000  // milliseconds - how long after CrossMgr stops sending data do we consider the race to be over?
 #define COLOUR_SET_INTERVAL 30000  //how frequently colours from CrossMgr are parsed in milliseconds
@@ -8,6 +9,104 @@
 #define RACE_TIME_UPDATE_INTERVAL 30000  //how often to re-sync the local race clock, don't want to do this too often as it may cause visible jitter (milliseconds)
 #define MAX_RACE_START_TIME_DELTA 750 //how many milliseconds do we allow the race start time to drift by without resetting
 #define NUM_LAPCOUNTERS 6 //how many lap counter fields to parse
+#define CROSSMGR_MAX_SUBSCRIBERS (NUM_LAPCOUNTERS * 2 + 4) //how many event subscribers can be registered at once: race data and colours for every group, and a few more
+#define CROSSMGR_ALL_GROUPS_MASK ((1 << NUM_LAPCOUNTERS) - 1)  //bitmask with a bit set for every lap counter
+#ifdef ENABLE_SPRINT_EXTENSIONS
+#define CROSSMGR_TIME_EXCHANGE_INTERVAL 10000  //default for how often to send the time to the sprint timer (milliseconds)
+#endif
+#define CROSSMGR_MIN_VALID_TIME 1577836800  //2020-01-01, a system clock earlier than this hasn't been set
+#ifdef ENABLE_LATENCY_TRACE
+#define CROSSMGR_TRACE_HISTORY 8  //how many recent trace records to keep
+#define CROSSMGR_TRACE_BUCKETS 48  //histogram buckets per stage, two per power of two microseconds
+#define CROSSMGR_TRACE_MAX_WIRE 60000  //milliseconds, longer times from tNow to arrival (usually a clock jump) are counted as this
+#endif
+#ifdef ENABLE_CHECKPOINT
+#define CROSSMGR_CHECKPOINT_FILE "/crossmgr.ckp"
+#define CROSSMGR_CHECKPOINT_MAGIC 0x434D5243  //"CRMC"
+#define CROSSMGR_CHECKPOINT_VERSION 1
+#define CROSSMGR_CHECKPOINT_MAX_AGE 600000  //milliseconds - a checkpoint older than this is from a race that has finished
+#define CROSSMGR_CHECKPOINT_TIMEOUT RACE_TIMEOUT  //how long restored data is shown for if live data doesn't confirm it (milliseconds)
+#endif
+#define CROSSMGR_TOKEN_SIZE 32  //longest key or value the JSON parser looks at, including the terminator
+#define CROSSMGR_MAX_DEPTH 16  //deepest nesting of arrays and objects the JSON parser accepts
+//JSON parser states
+#define CROSSMGR_JSON_VALUE 0		//expecting a value
+#define CROSSMGR_JSON_KEY 1			//expecting a key, or the end of an object
+#define CROSSMGR_JSON_COLON 2
+#define CROSSMGR_JSON_AFTER 3		//expecting a comma, or the end of an array or object
+#define CROSSMGR_JSON_STRING 4
+#define CROSSMGR_JSON_LITERAL 5		//number, true, false or null
+#define CROSSMGR_JSON_END 6			//after the top-level value
+#define CROSSMGR_JSON_ERROR 7
+//top-level members we use
+#define CROSSMGR_KEY_OTHER 0
+#define CROSSMGR_KEY_TNOW 1
+#define CROSSMGR_KEY_CUR_RACE_TIME 2
+#define CROSSMGR_KEY_LABELS 3
+#define CROSSMGR_KEY_FOREGROUNDS 4
+#define CROSSMGR_KEY_BACKGROUNDS 5
+#define CROSSMGR_KEY_LAP_ELAPSED_CLOCK 6
+#ifdef ENABLE_SPRINT_EXTENSIONS
+#define CROSSMGR_KEY_SPRINT_TIME 7
+#define CROSSMGR_KEY_SPRINT_SPEED 8
+#define CROSSMGR_KEY_SPRINT_BIB 9
+#define CROSSMGR_KEY_SPRINT_START 10
+#define CROSSMGR_KEY_SPEED_UNIT 11
+#define CROSSMGR_KEY_SPRINT_TIMEOUT 12
+#define CROSSMGR_KEY_TIME_ECHO 13
+#endif
+#ifdef ENABLE_DEFLATE
+//inflater states
+#define CROSSMGR_INFLATE_HEADER 0			//block header
+#define CROSSMGR_INFLATE_STORED_LENGTH 1
+#define CROSSMGR_INFLATE_STORED 2
+#define CROSSMGR_INFLATE_TABLE_SIZES 3		//dynamic block header
+#define CROSSMGR_INFLATE_CODE_LENGTHS 4
+#define CROSSMGR_INFLATE_LENGTHS 5
+#define CROSSMGR_INFLATE_SYMBOL 6			//compressed data
+#define CROSSMGR_INFLATE_DISTANCE 7
+#define CROSSMGR_INFLATE_COPY 8
+#define CROSSMGR_INFLATE_DONE 9				//after the final block
+#define CROSSMGR_INFLATE_ERROR 10
+
+//the server is asked to keep back references within this many bits, which sets the RAM used for the window
+#if defined (ARDUINO_ARCH_ESP32)
+#define CROSSMGR_INFLATE_WINDOW_BITS 13
+#else
+#define CROSSMGR_INFLATE_WINDOW_BITS 11
+#endif
+#define CROSSMGR_INFLATE_WINDOW (1 << CROSSMGR_INFLATE_WINDOW_BITS)
+
+//state of the DEFLATE decoder, kept between calls so that input can arrive in pieces
+typedef struct {
+	const uint8_t * in;				//input not yet consumed
+	const uint8_t * in_end;
+	uint32_t bits;					//bits not yet consumed, LSB first
+	int bit_count;
+	boolean starved;				//the current step ran out of input
+	uint8_t state;
+	boolean final_block;
+	uint16_t stored_remaining;		//bytes left in a stored block
+	int hlit;						//dynamic block table sizes
+	int hdist;
+	int hclen;
+	int index;						//progress through the code lengths
+	uint8_t lengths[286 + 30];
+	uint16_t code_length_count[16];	//Huffman tables, count of codes of each length and symbols in code order
+	uint16_t code_length_symbol[19];
+	uint16_t length_count[16];
+	uint16_t length_symbol[288];
+	uint16_t distance_count[16];
+	uint16_t distance_symbol[30];
+	int copy_length;				//match being copied
+	unsigned int copy_distance;
+	uint8_t window[CROSSMGR_INFLATE_WINDOW];	//history, and output waiting for the sink
+	unsigned int window_pos;
+	unsigned int window_flushed;	//window_pos when the sink was last called
+	unsigned int window_filled;		//how far back references can go
+	void (*sink)(const uint8_t * data, size_t length);
+} CrossMgrInflater;
+#endif
 
 #define DEBUG
 //#define DEBUG_JSON
@@ -24,6 +123,9 @@ unsigned long _crossmgr_last_got_race_time = -RACE_TIMEOUT;
 unsigned long _crossmgr_last_updated_race_time = -RACE_TIME_UPDATE_INTERVAL;
 unsigned long _crossmgr_last_colour_set = -COLOUR_SET_INTERVAL;
 unsigned long _crossmgr_last_clock_set = 0;
+time_t _crossmgr_wall_sync_time = 0;  //the last wall time received from CrossMgr...
+unsigned int _crossmgr_wall_sync_ms = 0;
+unsigned long _crossmgr_wall_sync_at = 0;  //...and the millis() it arrived at
 unsigned long _crossmgr_set_clock_at = 0;  //zero means time should be set on first connect
 time_t _crossmgr_time_to_set = 0;
 #ifdef ENABLE_SPRINT_EXTENSIONS
@@ -34,52 +136,191 @@ int _crossmgr_sprint_bib = -1;
 time_t _crossmgr_sprint_start_time = 0;
 char _crossmgr_sprint_unit[10] = "";
 int _crossmgr_sprint_timeout = -1;
+boolean _crossmgr_peer_wants_time = false;  //the server doesn't send tNow, so we send it the time instead
+unsigned long _crossmgr_time_exchange_interval = CROSSMGR_TIME_EXCHANGE_INTERVAL;
+unsigned long _crossmgr_time_sent_at = 0;
+uint32_t _crossmgr_time_seq = 0;  //sequence number of the last time sent
+boolean _crossmgr_time_outstanding = false;  //waiting for the echo of the last time sent
+long _crossmgr_rtt = -1;  //round trip times in milliseconds, -1 if not yet measured
+long _crossmgr_rtt_min = -1;
+long _crossmgr_rtt_max = -1;
+uint32_t _crossmgr_rtt_sum = 0;
+uint32_t _crossmgr_rtt_count = 0;
+uint32_t _crossmgr_rtt_lost = 0;
 #endif
 
 CRGB _crossmgr_fg_colour[NUM_LAPCOUNTERS];
 CRGB _crossmgr_bg_colour[NUM_LAPCOUNTERS];
 
+//event subscribers, fixed size so that dispatch never allocates
+typedef struct {
+	CrossMgrEventHandler fp;	//null if the slot is free
+	void * context;				//passed back to the handler untouched
+	CrossMgrEventType type;
+	int group;					//only called for this group, or CROSSMGR_ALL_GROUPS
+} CrossMgrSubscriber;
+CrossMgrSubscriber _crossmgr_subscribers[CROSSMGR_MAX_SUBSCRIBERS];
+
+#ifdef ENABLE_LATENCY_TRACE
+CrossMgrTrace _crossmgr_traces[CROSSMGR_TRACE_HISTORY];
+int _crossmgr_trace_head = -1;  //the most recent record, -1 if none yet
+boolean _crossmgr_trace_open = false;  //the most recent record is still waiting for the display
+uint32_t _crossmgr_trace_sequence = 0;
+uint16_t _crossmgr_trace_histogram[CROSSMGR_TRACE_STAGES][CROSSMGR_TRACE_BUCKETS];
+#endif
+
+#ifdef ENABLE_CHECKPOINT
+//last known state, written to flash so that it can be shown immediately after a reset
+//fixed-width fields so the file stays compatible between builds
+typedef struct {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t size;
+	uint32_t sequence;				//incremented on each write
+	uint8_t race_in_progress;
+	uint8_t lap_elapsed_clock;
+	uint8_t flash_laps;				//bitmask
+	uint8_t reserved;
+	int16_t laps[NUM_LAPCOUNTERS];
+	uint32_t lap_start_times[NUM_LAPCOUNTERS];
+	uint32_t race_elapsed;			//when written, for when the wall time is unknown
+	int64_t race_start_wall;		//epoch milliseconds, 0 if unknown
+	int64_t written_wall;			//epoch milliseconds, 0 if unknown
+	uint8_t fg_colour[NUM_LAPCOUNTERS][3];
+	uint8_t bg_colour[NUM_LAPCOUNTERS][3];
+	#ifdef ENABLE_SPRINT_EXTENSIONS
+	double sprint_time;
+	double sprint_speed;
+	int32_t sprint_bib;
+	int32_t sprint_timeout;
+	int64_t sprint_start_time;
+	char sprint_unit[10];
+	#endif
+	uint32_t crc;					//of everything above
+} CrossMgrCheckpoint;
+CrossMgrCheckpoint _crossmgr_checkpoint;  //as last written or restored
+boolean _crossmgr_checkpoint_enabled = false;
+unsigned long _crossmgr_checkpoint_interval = 0;
+unsigned long _crossmgr_last_checkpoint = 0;
+boolean _crossmgr_provisional = false;
+unsigned long _crossmgr_restored_at = 0;
+#endif
+
+//the fields we use from one message, filled in by the JSON parser as it arrives and acted on when it is complete
+typedef struct {
+	boolean have_race_time;
+	long cur_race_ms;
+	int laps[NUM_LAPCOUNTERS];
+	boolean flash[NUM_LAPCOUNTERS];
+	long lap_start[NUM_LAPCOUNTERS];
+	char tNow[24];				//empty if not sent
+	boolean lap_elapsed_clock;
+	boolean want_colours;		//colours are only parsed every COLOUR_SET_INTERVAL
+	unsigned int have_fg;		//bitmasks of the lap counters that colours were sent for
+	unsigned int have_bg;
+	CRGB fg_colour[NUM_LAPCOUNTERS];
+	CRGB bg_colour[NUM_LAPCOUNTERS];
+	#ifdef ENABLE_SPRINT_EXTENSIONS
+	double sprint_time;
+	double sprint_speed;
+	int sprint_bib;
+	time_t sprint_start;
+	boolean have_speed_unit;
+	char speed_unit[10];
+	int sprint_timeout;
+	boolean have_time_echo;		//this is a reply to crossMgrSendTime(), not race data
+	uint32_t time_echo;
+	#endif
+} CrossMgrFrame;
+CrossMgrFrame _crossmgr_frame;
+
+//JSON parser state, the same size whatever the size of the message
+typedef struct {
+	uint8_t state;
+	uint8_t depth;				//arrays and objects currently open
+	uint32_t arrays;			//bit n is set if the container at depth n is an array
+	int index[4];				//position in the arrays at depths 1 to 3
+	uint8_t key;				//CROSSMGR_KEY_ of the top-level member being parsed
+	boolean key_string;			//the string being parsed is a key
+	boolean escape;				//the last character was a backslash
+	uint8_t unicode;			//hex digits left to skip in a \u escape
+	char token[CROSSMGR_TOKEN_SIZE];	//the current key or scalar value
+	uint8_t token_length;
+	boolean token_overflow;		//it was too long, and is ignored
+	uint32_t offset;			//bytes parsed, for error messages
+} CrossMgrParser;
+CrossMgrParser _crossmgr_parser;
+
+boolean _crossmgr_message_in_progress = false;  //a text message has started and is being parsed
+long _crossmgr_message_started = 0;  //millis() when its first fragment arrived
+#ifdef ENABLE_LATENCY_TRACE
+unsigned long _crossmgr_message_started_us = 0;
+#endif
+
+//text messages received, for measuring the effect of compression
+uint32_t _crossmgr_frames_received = 0;
+uint32_t _crossmgr_bytes_received = 0;  //as sent over the network
+uint32_t _crossmgr_bytes_decoded = 0;  //after decompression
+uint32_t _crossmgr_inflate_us = 0;
+uint32_t _crossmgr_parse_us = 0;
+#ifdef ENABLE_DEFLATE
+boolean _crossmgr_deflate_active = false;  //negotiated for this connection
+boolean _crossmgr_deflate_refused = false;  //the server's compression couldn't be decoded, so stop offering it
+boolean _crossmgr_message_compressed = false;
+CrossMgrInflater _crossmgr_inflater;
+#endif
+
+//helpers private to this file
+static void crossMgrDispatch(CrossMgrEvent * event, unsigned int groups);
+static void crossMgrOnGotRaceData(unsigned long t, unsigned int changed_groups);
+static void crossMgrMessageBegin(long t);
+static void crossMgrMessageData(const uint8_t * payload, size_t length);
+static boolean crossMgrMessageEnd();
+static void crossMgrParseBegin();
+static void crossMgrParse(const uint8_t * data, size_t length);
+static boolean crossMgrParseEnd();
+static boolean crossMgrParseMillis(const char * p, const char * end, long * ms);
+static boolean crossMgrParseDecimal(const char * p, const char * end, long * value, int decimals);
+static void crossMgrCopyString(char * dest, size_t size, const char * p, const char * end);
+#if defined (ENABLE_CHECKPOINT) && defined (ENABLE_SPRINT_EXTENSIONS)
+static void crossMgrDiscardRestoredSprint();
+#endif
+#ifdef ENABLE_LATENCY_TRACE
+static long crossMgrParseTimeOfDay(const char * tNow);
+static void crossMgrTraceBegin(unsigned long received, unsigned long parsed, long crossmgr_time, unsigned int groups);
+static void crossMgrTraceDispatched();
+#endif
+#ifdef ENABLE_DEFLATE
+static void crossMgrCheckDeflate();
+static void crossMgrOfferDeflate();
+static void crossMgrRefuseDeflate();
+static void crossMgrInflateReset(CrossMgrInflater * s);
+static int crossMgrInflate(CrossMgrInflater * s, const uint8_t * in, size_t length);
+#endif
+
 
 //the websocket
 //note the TCP timeout setting in WebSockets.h:
 //#define WEBSOCKETS_TCP_TIMEOUT (5000)
-WebSocketsClient _crossmgr_webSocket;
-
-// The filter: it contains "true" for each value we want to keep
-/* size 224 calculated using https://arduinojson.org/v6/assistant/
-for:
-{
-  "tNow": true,
-  "curRaceTime": true,
-  "raceStartTime": true,
-  "labels": true,
-  "foregrounds": true,
-  "backgrounds": true,
-  "lapElapsedClock": true,
-  "sprintBib": true,
-  "sprintDistance": true,
-  "speedUnit": true,
-  "sprintStart": true,
-  "sprintTime": true,
-  "sprintSpeed": true
-  "sprintTimeout": true
-}
-size 112 calculated using https://arduinojson.org/v6/assistant/
-for:
-{
-  "tNow": true,
-  "curRaceTime": true,
-  "raceStartTime": true,
-  "labels": true,
-  "foregrounds": true,
-  "backgrounds": true,
-  "lapElapsedClock": true
-}
-*/
-#ifdef ENABLE_SPRINT_EXTENSIONS
-StaticJsonDocument<224> filter;
+#ifdef ENABLE_DEFLATE
+//WebSocketsClient doesn't pass on the RSV1 bit that marks a compressed message, so catch it on the way through
+class CrossMgrWebSocketsClient : public WebSocketsClient {
+	public:
+		boolean compressed = false;  //the message being received is compressed
+		const String & extensions() {  //Sec-WebSocket-Extensions sent by the server
+			return(_client.cExtensions);
+		}
+	protected:
+		void messageReceived(WSclient_t * client, WSopcode_t opcode, uint8_t * payload, size_t length, bool fin) {
+			if (opcode == WSop_text || opcode == WSop_binary) {  //only the first frame of a message has RSV1 set
+				compressed = client->cWsHeaderDecode.rsv1;
+			}
+			WebSocketsClient::messageReceived(client, opcode, payload, length, fin);
+		}
+};
+CrossMgrWebSocketsClient _crossmgr_webSocket;
 #else
-StaticJsonDocument<112> filter;
+WebSocketsClient _crossmgr_webSocket;
 #endif
 
 void crossMgrSetup(IPAddress ip, int reconnect_interval) {
@@ -92,30 +333,8 @@ void crossMgrSetup(IPAddress ip, int reconnect_interval, CRGB default_fg, CRGB d
 
 void crossMgrSetup(IPAddress ip, int reconnect_interval, boolean override_colours, CRGB default_fg, CRGB default_bg) {
 	_crossmgr_overrride_default_colours = override_colours;
-	//set up JSON filter to only process the fields we need
-	filter["tNow"] = true;				//wall time
-	//filter["raceStartTime"] = true;	//we don't need both of these
-	filter["curRaceTime"] = true;		//this one is easier to parse
-	filter["labels"] = true;			//lap counters
-	filter["foregrounds"] = true;		//foreground colour
-	filter["backgrounds"] = true;		//background colour
-	filter["lapElapsedClock"] = true;	//enable lap elapsed time
-	#ifdef ENABLE_SPRINT_EXTENSIONS
-	//filter["sprintDistance"] = true;	//we don't use this
- 	filter["sprintBib"] = true;			//bib number for sprint mode
- 	filter["sprintStart"] = true;		//epioch time the sprint was recorded
- 	filter["sprintTime"] = true;		//sprint time (float seconds)
- 	filter["sprintSpeed"] = true;		//sprint speed (unitless float)
- 	filter["speedUnit"] = true;			//sprint unit (string)
- 	filter["sprintTimeout"] = true;		//timeout (int seconds)
-	#endif
-	#if defined (DEBUG_JSON) || defined (DEBUG)
-	char buf[200];
-	#endif
-	#if defined DEBUG_JSON
-	serializeJsonPretty(filter, buf);
-	crossMgrDebug(buf);
-	crossMgrDebug(F("\r\n"));
+	#ifdef DEBUG
+	char buf[100];
 	#endif
 	//init lapcounter data
 	for (int i = 0; i < NUM_LAPCOUNTERS; i++) {
@@ -132,7 +351,7 @@ void crossMgrSetup(IPAddress ip, int reconnect_interval, boolean override_colour
 	snprintf_P(buf, sizeof(buf), PSTR("[CMr] Connecting websocket client to %u.%u.%u.%u:%u\r\n"), ip[0], ip[1], ip[2], ip[3], CROSSMGR_PORT);
 	crossMgrDebug(buf);
 	#endif
-	_crossmgr_webSocket.begin(ip, CROSSMGR_PORT, "/");
+	crossMgrConnect(ip);
 	//event handler
 	_crossmgr_webSocket.onEvent(crossMgrWebSocketEvent);
 	_crossmgr_webSocket.setReconnectInterval(reconnect_interval);
@@ -149,6 +368,9 @@ void crossMgrDisconnect() {
 
 void crossMgrConnect(IPAddress ip) {
 	_crossmgr_webSocket.begin(ip, CROSSMGR_PORT, "/");
+	#ifdef ENABLE_DEFLATE
+	crossMgrOfferDeflate();  //begin() resets the extra headers
+	#endif
 }
 
 boolean crossMgrConnected() {
@@ -187,6 +409,27 @@ unsigned long crossMgrRaceElapsed() {
 	return(millis() - _crossmgr_race_start);
 }
 
+int64_t crossMgrWallTimeMillis() {
+//current wall time as epoch milliseconds, extrapolated from the last time CrossMgr sent it, or 0 if unknown
+	if (_crossmgr_last_clock_set != 0) {
+		return((int64_t)_crossmgr_wall_sync_time * 1000 + _crossmgr_wall_sync_ms + (millis() - _crossmgr_wall_sync_at));
+	}
+	#if defined (ARDUINO_ARCH_ESP32)
+	//the ESP32's clock survives a software reset, so it may already be set
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	if (tv.tv_sec > CROSSMGR_MIN_VALID_TIME) {
+		return((int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000);
+	}
+	#else
+	//the application may have set TimeLib's clock some other way, but only to the second
+	if (timeStatus() != timeNotSet && now() > CROSSMGR_MIN_VALID_TIME) {
+		return((int64_t)now() * 1000);
+	}
+	#endif
+	return(0);
+}
+
 CRGB crossMgrGetFGColour(int group) {
 	return(crossMgrGetColour(group, true));
 }
@@ -203,6 +446,52 @@ CRGB crossMgrGetColour(int group, boolean foreground) {
 	}
 }
 
+int crossMgrSubscribe(CrossMgrEventType type, CrossMgrEventHandler fp, void * context) {
+	return(crossMgrSubscribe(type, fp, context, CROSSMGR_ALL_GROUPS));
+}
+
+int crossMgrSubscribe(CrossMgrEventType type, CrossMgrEventHandler fp, void * context, int group) {
+	if (0 == fp || group < CROSSMGR_ALL_GROUPS || group >= NUM_LAPCOUNTERS) {
+		return(-1);
+	}
+	for (int i = 0; i < CROSSMGR_MAX_SUBSCRIBERS; i++) {
+		if (0 == _crossmgr_subscribers[i].fp) {
+			_crossmgr_subscribers[i].fp = fp;
+			_crossmgr_subscribers[i].context = context;
+			_crossmgr_subscribers[i].type = type;
+			_crossmgr_subscribers[i].group = group;
+			return(i);
+		}
+	}
+	return(-1);  //no free slots
+}
+
+void crossMgrUnsubscribe(int handle) {
+	if (handle >= 0 && handle < CROSSMGR_MAX_SUBSCRIBERS) {
+		_crossmgr_subscribers[handle].fp = 0;
+	}
+}
+
+static void crossMgrDispatch(CrossMgrEvent * event, unsigned int groups) {
+//calls every subscriber for this event type
+//subscribers with a group filter are only called if their group's bit is set in groups, once per group
+//subscribers without a filter are called once, with the group given in the event
+	for (int i = 0; i < CROSSMGR_MAX_SUBSCRIBERS; i++) {
+		CrossMgrSubscriber * sub = &_crossmgr_subscribers[i];
+		if (0 == sub->fp || sub->type != event->type) {
+			continue;
+		}
+		if (sub->group == CROSSMGR_ALL_GROUPS) {
+			(*sub->fp)(event, sub->context);
+		} else if (groups & (1 << sub->group)) {
+			int g = event->group;
+			event->group = sub->group;
+			(*sub->fp)(event, sub->context);
+			event->group = g;
+		}
+	}
+}
+
 #ifdef ENABLE_SPRINT_EXTENSIONS
 double crossMgrSprintTime() {
 	return(_crossmgr_sprint_time);
@@ -237,10 +526,100 @@ void crossMgrSetOnGotSprintData(void (*fp)(const unsigned long t)) {
 	fpOnGotSprintData = fp;
 }
 
+void crossMgrSetTimeSyncInterval(unsigned long interval) {
+	_crossmgr_time_exchange_interval = interval;
+}
+
+long crossMgrTimeSyncRTT() {
+	return(_crossmgr_rtt);
+}
+
+long crossMgrTimeSyncMinRTT() {
+	return(_crossmgr_rtt_min);
+}
+
+long crossMgrTimeSyncMaxRTT() {
+	return(_crossmgr_rtt_max);
+}
+
+long crossMgrTimeSyncMeanRTT() {
+	if (_crossmgr_rtt_count == 0) {
+		return(-1);
+	}
+	return(_crossmgr_rtt_sum / _crossmgr_rtt_count);
+}
+
+unsigned long crossMgrTimeSyncCount() {
+	return(_crossmgr_rtt_count);
+}
+
+unsigned long crossMgrTimeSyncLost() {
+	return(_crossmgr_rtt_lost);
+}
+
+static void crossMgrSendTime() {
+/* Sends our wall time to the sprint timer as {"time":<epoch seconds>,"millis":<ms>,"seq":<n>,"rtt":<ms>}
+ * A sprint timer that supports it replies straight away with {"timeEcho":<n>}, and we measure the round trip.
+ * "rtt" is the last round trip time measured (-1 if none), so the peer can add half of it to allow for the path delay.
+ * If we only know the time to the second, just {"time":<epoch seconds>} is sent and there is no round trip to time.
+ * Older sprint timers just use "time".
+ */
+	int64_t wall = crossMgrWallTimeMillis();
+	if (wall == 0) {
+		return;  //we don't know either
+	}
+	boolean precise = true;
+	#if ! defined (ARDUINO_ARCH_ESP32)
+	precise = (_crossmgr_last_clock_set != 0);  //otherwise it came from TimeLib, which only keeps whole seconds
+	#endif
+	if (_crossmgr_time_outstanding) {
+		_crossmgr_rtt_lost++;
+	}
+	_crossmgr_time_seq++;
+	char out_string[80];
+	if (precise) {
+		snprintf_P(out_string, sizeof(out_string), PSTR("{\"time\":%lu,\"millis\":%u,\"seq\":%lu,\"rtt\":%ld}"),
+			(unsigned long)(wall / 1000), (unsigned int)(wall % 1000), (unsigned long)_crossmgr_time_seq, _crossmgr_rtt);
+	} else {
+		snprintf_P(out_string, sizeof(out_string), PSTR("{\"time\":%lu}"), (unsigned long)(wall / 1000));
+	}
+	_crossmgr_time_sent_at = millis();
+	_crossmgr_time_outstanding = precise;
+	_crossmgr_webSocket.sendTXT(out_string);
+	#ifdef DEBUG
+	char buf[100];
+	snprintf_P(buf, sizeof(buf), PSTR("[CMr] Sending: %s\r\n"), out_string);
+	crossMgrDebug(buf);
+	#endif
+}
+
+static void crossMgrHandleTimeEcho(uint32_t seq) {
+//called with the seq from a reply to crossMgrSendTime(), records the round trip time
+	if (_crossmgr_time_outstanding && seq == _crossmgr_time_seq) {
+		_crossmgr_time_outstanding = false;
+		_crossmgr_rtt = millis() - _crossmgr_time_sent_at;
+		if (_crossmgr_rtt_min < 0 || _crossmgr_rtt < _crossmgr_rtt_min) {
+			_crossmgr_rtt_min = _crossmgr_rtt;
+		}
+		if (_crossmgr_rtt > _crossmgr_rtt_max) {
+			_crossmgr_rtt_max = _crossmgr_rtt;
+		}
+		_crossmgr_rtt_sum += _crossmgr_rtt;
+		_crossmgr_rtt_count++;
+		#ifdef DEBUG
+		char buf[100];
+		snprintf_P(buf, sizeof(buf), PSTR("[CMr] Time exchange %lu round trip: %li ms\r\n"), (unsigned long)_crossmgr_time_seq, _crossmgr_rtt);
+		crossMgrDebug(buf);
+		#endif
+	}
+}
+
 void crossMgrOnGotSprintData(unsigned long t) {  //callback for when sprint data arrives
 	if (0 != fpOnGotSprintData) {
 		(*fpOnGotSprintData)(t);
 	}
+	CrossMgrEvent event = { CROSSMGR_EVENT_SPRINT_DATA, CROSSMGR_ALL_GROUPS, t, _crossmgr_wsc_connected, 0 };
+	crossMgrDispatch(&event, CROSSMGR_ALL_GROUPS_MASK);
 }
 #endif
 
@@ -275,6 +654,8 @@ void crossMgrOnNetwork() {
 	if (0 != fpOnNetwork) {
 		(*fpOnNetwork)(_crossmgr_wsc_connected);
 	}
+	CrossMgrEvent event = { CROSSMGR_EVENT_NETWORK, CROSSMGR_ALL_GROUPS, millis(), _crossmgr_wsc_connected, 0 };
+	crossMgrDispatch(&event, CROSSMGR_ALL_GROUPS_MASK);
 }
 
 void (*fpOnGotRaceData)(const unsigned long t);
@@ -283,9 +664,15 @@ void crossMgrSetOnGotRaceData(void (*fp)(const unsigned long t)) {
 }
 
 void crossMgrOnGotRaceData(unsigned long t) {  //callback for when race data arrives
+	crossMgrOnGotRaceData(t, CROSSMGR_ALL_GROUPS_MASK);
+}
+
+static void crossMgrOnGotRaceData(unsigned long t, unsigned int changed_groups) {  //as above, group subscribers are only called if their bit is set
 	if (0 != fpOnGotRaceData) {
 		(*fpOnGotRaceData)(t);
 	}
+	CrossMgrEvent event = { CROSSMGR_EVENT_RACE_DATA, CROSSMGR_ALL_GROUPS, t, _crossmgr_wsc_connected, 0 };
+	crossMgrDispatch(&event, changed_groups);
 }
 
 void (*fpOnGotColours)(const int group);
@@ -297,6 +684,8 @@ void crossMgrOnGotColours(int group) {  //callback for when colour data arrives
 	if (0 != fpOnGotColours) {
 		(*fpOnGotColours)(group);
 	}
+	CrossMgrEvent event = { CROSSMGR_EVENT_COLOURS, group, millis(), _crossmgr_wsc_connected, 0 };
+	crossMgrDispatch(&event, 1 << group);
 }
 
 void crossMgrDebug (const __FlashStringHelper * line) {
@@ -314,6 +703,8 @@ void crossMgrDebug(const char * line) {  //callback for debugging output
 	if (0 != fpOnDebug) {
 		(*fpOnDebug)(line);
 	}
+	CrossMgrEvent event = { CROSSMGR_EVENT_DEBUG, CROSSMGR_ALL_GROUPS, millis(), _crossmgr_wsc_connected, line };
+	crossMgrDispatch(&event, CROSSMGR_ALL_GROUPS_MASK);
 }
 
 void crossMgrLoop() {
@@ -324,10 +715,37 @@ void crossMgrLoop() {
 		_crossmgr_set_clock_at = 0;
 	}
 	#endif
+	#ifdef ENABLE_SPRINT_EXTENSIONS
+	if (_crossmgr_peer_wants_time && _crossmgr_wsc_connected && (_crossmgr_time_seq == 0 || millis() - _crossmgr_time_sent_at >= _crossmgr_time_exchange_interval)) {
+		crossMgrSendTime();
+	}
+	#endif
+	#ifdef ENABLE_CHECKPOINT
+	if (_crossmgr_provisional && millis() - _crossmgr_restored_at > CROSSMGR_CHECKPOINT_TIMEOUT) {  //restored data was never confirmed
+		crossMgrDebug(F("[CMr] Restored race state was not confirmed, discarding.\r\n"));
+		_crossmgr_provisional = false;
+		_crossmgr_race_in_progress = false;
+		for (int i = 0; i < NUM_LAPCOUNTERS; i++) {
+			_crossmgr_laps[i] = 0;
+			_crossmgr_flash_laps[i] = false;
+		}
+		crossMgrOnGotRaceData(millis());
+		#ifdef ENABLE_SPRINT_EXTENSIONS
+		crossMgrDiscardRestoredSprint();
+		#endif
+	}
+	if (_crossmgr_checkpoint_enabled && _crossmgr_wsc_connected && !_crossmgr_provisional && millis() - _crossmgr_last_checkpoint >= _crossmgr_checkpoint_interval) {
+		_crossmgr_last_checkpoint = millis();
+		crossMgrSaveCheckpoint();
+	}
+	#endif
 }
 
 void crossMgrWebSocketEvent(WStype_t type, uint8_t * payload, size_t length) {
 long websocket_event_time = millis();
+#ifdef ENABLE_LATENCY_TRACE
+unsigned long websocket_event_us = micros();
+#endif
 boolean haveJSON = false;
 switch(type) {
 	case WStype_DISCONNECTED:
@@ -335,7 +753,12 @@ switch(type) {
 		crossMgrDebug(F("[CMr] WebSocket disconnected!\r\n"));
 		#endif
 		_crossmgr_wsc_connected = false;
+		_crossmgr_message_in_progress = false;  //it won't be finished
 		crossMgrOnNetwork();
+		#ifdef ENABLE_SPRINT_EXTENSIONS
+		_crossmgr_peer_wants_time = false;  //we might reconnect to something else
+		_crossmgr_time_outstanding = false;
+		#endif
 		//these are now unknown!
 		for (int i = 0; i < NUM_LAPCOUNTERS; i++) {
 			_crossmgr_laps[i] = 0;
@@ -351,34 +774,55 @@ switch(type) {
 		crossMgrDebug(buf);
 		#endif
 		_crossmgr_last_updated_race_time = 0;  //clear this so that race time updates immediately on reconnect
+		#ifdef ENABLE_DEFLATE
+		crossMgrCheckDeflate();
+		#endif
+		break;
+	case WStype_FRAGMENT_TEXT_START:  //parse each fragment as it arrives
+		crossMgrOnNetwork();
+		crossMgrMessageBegin(websocket_event_time);
+		crossMgrMessageData(payload, length);
+		break;
+	case WStype_FRAGMENT:
+		crossMgrOnNetwork();
+		crossMgrMessageData(payload, length);  //ignored if it's part of a binary message
 		break;
 	case WStype_TEXT:
+	case WStype_FRAGMENT_FIN:
 		{
 			crossMgrOnNetwork();
-			//allocate memory for JSON parsing document
-			#if defined (ARDUINO_ARCH_ESP32)
-			StaticJsonDocument<768> doc;
-			#else
-			StaticJsonDocument<384> doc;
+			if (type == WStype_TEXT) {
+				crossMgrMessageBegin(websocket_event_time);
+			}
+			crossMgrMessageData(payload, length);
+			boolean complete = crossMgrMessageEnd();
+			//race times are relative to when the message started to arrive
+			websocket_event_time = _crossmgr_message_started;
+			#ifdef ENABLE_LATENCY_TRACE
+			websocket_event_us = _crossmgr_message_started_us;
 			#endif
-			//deserialize the JSON document
-			DeserializationError error = deserializeJson(doc, (char*)payload, length, DeserializationOption::Filter(filter));  //using filter
-			//DeserializationError error = deserializeJson(doc, (char*)payload, length);  //without filter
-			//test if parsing succeeds...
-			if (error) {
-				crossMgrDebug("[Err] deserializeJson() failed: ");
-				crossMgrDebug(error.c_str());
-				crossMgrDebug(F("\r\n"));
-			} else {
-				#ifdef DEBUG_JSON
-				char buf[400];
-				serializeJsonPretty(doc, buf);
-				crossMgrDebug(buf);
-				crossMgrDebug(F("\r\n"));
+			CrossMgrFrame * frame = &_crossmgr_frame;
+			#ifdef ENABLE_SPRINT_EXTENSIONS
+			if (complete && frame->have_time_echo) {
+				crossMgrHandleTimeEcho(frame->time_echo);
+				break;  //not race data
+			}
+			#endif
+			if (complete) {  //otherwise crossMgrMessageEnd() has said why
+				#ifdef ENABLE_CHECKPOINT
+				if (_crossmgr_provisional) {  //live data replaces anything restored from the checkpoint
+					crossMgrDebug(F("[CMr] Got live data, restored race state no longer provisional.\r\n"));
+					_crossmgr_provisional = false;
+					#ifdef ENABLE_SPRINT_EXTENSIONS
+					if (frame->sprint_time == 0) {  //the peer has no sprint result, so the restored one is stale
+						crossMgrDiscardRestoredSprint();
+					}
+					#endif
+				}
 				#endif
 				//if we haven't recently, get the wall time and set the clock
 				if (_crossmgr_last_clock_set == 0 || millis() - _crossmgr_last_clock_set >= CROSSMGR_CLOCK_SYNC_INTERVAL) {  
-					const char* tNow = doc["tNow"];
+					const char* tNow = frame->tNow[0] ? frame->tNow : nullptr;
 					if (tNow) {  //if we have time data, parse it and set the clock
 						char Y[5];
 						Y[0] = tNow[0];
@@ -433,39 +877,32 @@ switch(type) {
 						crossmgr_time = makeTime(tm);
 						#endif
 						unsigned int crossmgr_millis = atoi(mi);
+						_crossmgr_wall_sync_time = crossmgr_time;
+						_crossmgr_wall_sync_ms = crossmgr_millis;
+						_crossmgr_wall_sync_at = websocket_event_time;
 						crossMgrOnWallTime(crossmgr_time, crossmgr_millis);
 						#ifdef DEBUG
 						//we do this after the time-critical bit
-						char buf[100];
+						char buf[180];
 						snprintf_P(buf, sizeof(buf), PSTR("[CMr] Received wall time: %s (%u.%i)\r\n"), tNow, crossmgr_time, crossmgr_millis);
 						crossMgrDebug(buf);
 						#endif
 						_crossmgr_last_clock_set = millis();
-					#ifdef ENABLE_SPRINT_EXTENSIONS
-					} else if (_crossmgr_last_clock_set != 0) {  //send local time to server (for sprint timer, which does not have its own RTC)
-						StaticJsonDocument<30> timeDoc;
-						#if defined (ARDUINO_ARCH_ESP32)
-						timeDoc["time"] = time(nullptr);
-						#else
-						timeDoc["time"] = now();
-						#endif
-						char out_string[50];
-						serializeJson(timeDoc, out_string);
-						#ifdef DEBUG
-						char buf[100];
-						snprintf_P(buf, sizeof(buf), PSTR("[CMr] Sending: %s\r\n"), out_string);
-						crossMgrDebug(buf);
-						#endif
-						_crossmgr_webSocket.sendTXT(out_string);
-					#endif
 					}
 				}
+				#ifdef ENABLE_SPRINT_EXTENSIONS
+				if (frame->tNow[0] == '\0') {  //no wall time, so this is the sprint timer, which does not have its own RTC and gets the time from us
+					_crossmgr_peer_wants_time = true;
+				}
+				#endif
+				unsigned int changed_groups = 0;  //bitmask of lap counters whose data changed in this frame
+				boolean was_in_progress = _crossmgr_race_in_progress;
 				//update race in progress and start time
-				double curRaceTime = doc["curRaceTime"];
-				if (curRaceTime) {
+				long cur_race_ms = frame->cur_race_ms;
+				if (frame->have_race_time && cur_race_ms != 0) {
 					_crossmgr_last_got_race_time = websocket_event_time;
 					_crossmgr_race_in_progress = true;
-					long new_start = websocket_event_time - (curRaceTime * 1000);
+					long new_start = websocket_event_time - cur_race_ms;
 					long diff = _crossmgr_race_start - new_start;
 					if (_crossmgr_last_updated_race_time == 0 || (abs(diff) > MAX_RACE_START_TIME_DELTA && millis() - _crossmgr_last_updated_race_time > RACE_TIME_UPDATE_INTERVAL)) {
 						_crossmgr_last_updated_race_time = millis();
@@ -481,22 +918,31 @@ switch(type) {
 					_crossmgr_last_updated_race_time = 0;
 				}
 				//display lap elapsed clock field
-				_crossmgr_lap_elapsed_clock = doc["lapElapsedClock"];
+				if (frame->lap_elapsed_clock != _crossmgr_lap_elapsed_clock) {  //every group's display changes mode
+					changed_groups = CROSSMGR_ALL_GROUPS_MASK;
+				}
+				_crossmgr_lap_elapsed_clock = frame->lap_elapsed_clock;
 				//lap counts
 				for (int i = 0; i < NUM_LAPCOUNTERS; i++) {
-					_crossmgr_laps[i] = doc["labels"][i][0];
-					_crossmgr_flash_laps[i] = doc["labels"][i][1];
-					double ltime = doc["labels"][i][2];
-					_crossmgr_lap_start_times[i] = ltime * 1000.0;
+					int laps = frame->laps[i];
+					boolean flash = frame->flash[i];
+					unsigned long lap_start = frame->lap_start[i];
+					if (laps != _crossmgr_laps[i] || flash != _crossmgr_flash_laps[i] || lap_start != _crossmgr_lap_start_times[i]) {
+						changed_groups |= 1 << i;
+					}
+					_crossmgr_laps[i] = laps;
+					_crossmgr_flash_laps[i] = flash;
+					_crossmgr_lap_start_times[i] = lap_start;
+				}
+				if (was_in_progress != _crossmgr_race_in_progress) {
+					changed_groups = CROSSMGR_ALL_GROUPS_MASK;
 				}
 				//colours
-				if (websocket_event_time - _crossmgr_last_colour_set > COLOUR_SET_INTERVAL || _crossmgr_last_colour_set == 0) {
+				if (frame->want_colours) {
 					for (int i = 0; i < NUM_LAPCOUNTERS; i++) {
-						const char* foreground_string = doc["foregrounds"][i];
-						const char* background_string = doc["backgrounds"][i];
-						if (foreground_string != nullptr && background_string != nullptr) {
-							CRGB fg_colour = crossMgrParseColour(foreground_string);
-							CRGB bg_colour = crossMgrParseColour(background_string);
+						if ((frame->have_fg & frame->have_bg) & (1 << i)) {
+							CRGB fg_colour = frame->fg_colour[i];
+							CRGB bg_colour = frame->bg_colour[i];
 							if (_crossmgr_overrride_default_colours && crossMgrColoursAreDefault(i, fg_colour, bg_colour)) {
 								#ifdef DEBUG
 								char buf[100];
@@ -522,12 +968,12 @@ switch(type) {
 				#ifdef ENABLE_SPRINT_EXTENSIONS
 				//sprint fields 
 				//(this is an extension to the CrossMgr protocol for displaying results from the BHPC sprint timing system)
-				double sprintTime = doc["sprintTime"];
-				double sprintSpeed = doc["sprintSpeed"];
-				int sprintBib = doc["sprintBib"];
-				time_t sprintStart = doc["sprintStart"];
-				const char* speedUnit = doc["speedUnit"];
-				int sprintTimeout = doc["sprintTimeout"];
+				double sprintTime = frame->sprint_time;
+				double sprintSpeed = frame->sprint_speed;
+				int sprintBib = frame->sprint_bib;
+				time_t sprintStart = frame->sprint_start;
+				const char* speedUnit = frame->have_speed_unit ? frame->speed_unit : nullptr;
+				int sprintTimeout = frame->sprint_timeout;
 				boolean new_sprint = false;
 				if (sprintTime > 0) {
 					_crossmgr_last_got_sprint_data = websocket_event_time;
@@ -590,7 +1036,7 @@ switch(type) {
 				}
 				if (speedUnit) {
 					if (strcmp(speedUnit, _crossmgr_sprint_unit) != 0) {
-						snprintf_P(_crossmgr_sprint_unit, sizeof(_crossmgr_sprint_unit), PSTR("%s"), speedUnit);
+						crossMgrCopyString(_crossmgr_sprint_unit, sizeof(_crossmgr_sprint_unit), speedUnit, speedUnit + strlen(speedUnit));
 						#ifdef DEBUG
 						char buf[100];
 						snprintf_P(buf, sizeof(buf), PSTR("[CMr] Got new speed unit: %s\r\n"), _crossmgr_sprint_unit);
@@ -623,17 +1069,37 @@ switch(type) {
 						_crossmgr_sprint_start_time = 0;
 						crossMgrDebug(F("[CMr] Did not get a start time!\r\n"));
 					}
+				}
+				#endif
+				#ifdef ENABLE_LATENCY_TRACE
+				//trace frames that change what should be displayed
+				boolean traced = (changed_groups != 0);
+				#ifdef ENABLE_SPRINT_EXTENSIONS
+				traced = traced || new_sprint;
+				#endif
+				if (traced) {
+					crossMgrTraceBegin(websocket_event_us, micros(), crossMgrParseTimeOfDay(frame->tNow[0] ? frame->tNow : nullptr), changed_groups);
+				}
+				#endif
+				#ifdef ENABLE_SPRINT_EXTENSIONS
+				if (new_sprint) {
 					crossMgrOnGotSprintData(websocket_event_time);
 				} else {
 				#endif
-				crossMgrOnGotRaceData(websocket_event_time);
+				crossMgrOnGotRaceData(websocket_event_time, changed_groups);
 				#ifdef ENABLE_SPRINT_EXTENSIONS
 				}
 				#endif
+				#ifdef ENABLE_LATENCY_TRACE
+				if (traced) {
+					crossMgrTraceDispatched();
+				}
+				#endif
 			}
 		}
 		break;
 	case WStype_BIN:
+	case WStype_FRAGMENT_BIN_START:
 		_crossmgr_wsc_connected = true;
 		crossMgrOnNetwork();
 		crossMgrDebug(F("[CMr] WebSocket got binary, ignoring.\r\n"));
@@ -664,6 +1130,488 @@ switch(type) {
 	}
 }
 
+/* Messages are parsed as they arrive, a fragment (or a piece of decompressed output) at a time,
+ * so that a message of any size can be handled without holding all of it.  The parser keeps only
+ * its position in the JSON and the current key or scalar value, and writes the fields we use into
+ * _crossmgr_frame, which is acted on when the message is complete.
+ * It only understands as much JSON as CrossMgr sends, and treats anything it doesn't use, or that
+ * is too long for the token buffer, as missing, in the same way that ArduinoJson returns 0 for a
+ * missing or mistyped field.
+ */
+static void crossMgrMessageBegin(long t) {
+//called for the first fragment of a text message, t is millis() when it arrived
+	_crossmgr_message_in_progress = true;
+	_crossmgr_message_started = t;
+	#ifdef ENABLE_LATENCY_TRACE
+	_crossmgr_message_started_us = micros();
+	#endif
+	_crossmgr_frames_received++;
+	crossMgrParseBegin();
+	//colours rarely change, so only look at them every COLOUR_SET_INTERVAL
+	_crossmgr_frame.want_colours = (t - _crossmgr_last_colour_set > COLOUR_SET_INTERVAL || _crossmgr_last_colour_set == 0);
+	#ifdef ENABLE_DEFLATE
+	_crossmgr_message_compressed = _crossmgr_webSocket.compressed;
+	if (_crossmgr_message_compressed) {
+		if (!_crossmgr_deflate_active) {
+			crossMgrDebug(F("[Err] Got a compressed frame without negotiating compression.\r\n"));
+			_crossmgr_message_in_progress = false;
+			return;
+		}
+		if (_crossmgr_inflater.state == CROSSMGR_INFLATE_DONE) {  //the last message ended the stream, this one starts a new one
+			_crossmgr_inflater.state = CROSSMGR_INFLATE_HEADER;
+			_crossmgr_inflater.bits = 0;  //drop the padding after the final block, the new stream starts on a byte boundary
+			_crossmgr_inflater.bit_count = 0;
+		}
+		_crossmgr_inflater.sink = crossMgrParse;
+	}
+	#endif
+}
+
+static void crossMgrMessageData(const uint8_t * payload, size_t length) {
+//called for each fragment of a text message, including the first and last
+	if (!_crossmgr_message_in_progress) {  //a binary message, or one we've given up on
+		return;
+	}
+	_crossmgr_bytes_received += length;
+	#ifdef ENABLE_DEFLATE
+	if (_crossmgr_message_compressed) {
+		unsigned long start = micros();
+		uint32_t parse_us = _crossmgr_parse_us;
+		int result = crossMgrInflate(&_crossmgr_inflater, payload, length);  //calls crossMgrParse() with the output
+		_crossmgr_inflate_us += (micros() - start) - (_crossmgr_parse_us - parse_us);
+		if (result < 0) {
+			//the history that later messages refer back to may be wrong, so start again without compression
+			crossMgrDebug(F("[Err] Invalid compressed frame, reconnecting without compression.\r\n"));
+			_crossmgr_message_in_progress = false;
+			crossMgrRefuseDeflate();
+		}
+		return;
+	}
+	#endif
+	crossMgrParse(payload, length);
+}
+
+static boolean crossMgrMessageEnd() {
+//called after the last fragment of a text message, returns true if _crossmgr_frame holds a complete message
+	if (!_crossmgr_message_in_progress) {
+		return(false);
+	}
+	_crossmgr_message_in_progress = false;
+	#ifdef ENABLE_DEFLATE
+	if (_crossmgr_message_compressed) {
+		static const uint8_t tail[4] = { 0x00, 0x00, 0xFF, 0xFF };  //removed by the sender, it ends the message on a block boundary
+		_crossmgr_message_in_progress = true;
+		crossMgrMessageData(tail, sizeof(tail));
+		_crossmgr_bytes_received -= sizeof(tail);
+		if (!_crossmgr_message_in_progress) {
+			return(false);
+		}
+		_crossmgr_message_in_progress = false;
+	}
+	#endif
+	#ifdef DEBUG_JSON
+	crossMgrDebug(F("\r\n"));
+	#endif
+	return(crossMgrParseEnd());
+}
+
+static void crossMgrParseBegin() {
+	memset(&_crossmgr_parser, 0, sizeof(_crossmgr_parser));
+	_crossmgr_parser.state = CROSSMGR_JSON_VALUE;
+	_crossmgr_frame = CrossMgrFrame();
+}
+
+static void crossMgrParseToken(char c) {
+	if (_crossmgr_parser.token_length < CROSSMGR_TOKEN_SIZE - 1) {
+		_crossmgr_parser.token[_crossmgr_parser.token_length++] = c;
+	} else {
+		_crossmgr_parser.token_overflow = true;
+	}
+}
+
+static uint8_t crossMgrParseKey(const char * key) {
+//returns the CROSSMGR_KEY_ for a top-level member name
+	if (strcmp_P(key, PSTR("tNow")) == 0) {
+		return(CROSSMGR_KEY_TNOW);
+	} else if (strcmp_P(key, PSTR("curRaceTime")) == 0) {
+		return(CROSSMGR_KEY_CUR_RACE_TIME);
+	} else if (strcmp_P(key, PSTR("labels")) == 0) {
+		return(CROSSMGR_KEY_LABELS);
+	} else if (strcmp_P(key, PSTR("foregrounds")) == 0) {
+		return(CROSSMGR_KEY_FOREGROUNDS);
+	} else if (strcmp_P(key, PSTR("backgrounds")) == 0) {
+		return(CROSSMGR_KEY_BACKGROUNDS);
+	} else if (strcmp_P(key, PSTR("lapElapsedClock")) == 0) {
+		return(CROSSMGR_KEY_LAP_ELAPSED_CLOCK);
+	#ifdef ENABLE_SPRINT_EXTENSIONS
+	} else if (strcmp_P(key, PSTR("sprintTime")) == 0) {
+		return(CROSSMGR_KEY_SPRINT_TIME);
+	} else if (strcmp_P(key, PSTR("sprintSpeed")) == 0) {
+		return(CROSSMGR_KEY_SPRINT_SPEED);
+	} else if (strcmp_P(key, PSTR("sprintBib")) == 0) {
+		return(CROSSMGR_KEY_SPRINT_BIB);
+	} else if (strcmp_P(key, PSTR("sprintStart")) == 0) {
+		return(CROSSMGR_KEY_SPRINT_START);
+	} else if (strcmp_P(key, PSTR("speedUnit")) == 0) {
+		return(CROSSMGR_KEY_SPEED_UNIT);
+	} else if (strcmp_P(key, PSTR("sprintTimeout")) == 0) {
+		return(CROSSMGR_KEY_SPRINT_TIMEOUT);
+	} else if (strcmp_P(key, PSTR("timeEcho")) == 0) {
+		return(CROSSMGR_KEY_TIME_ECHO);
+	#endif
+	}
+	return(CROSSMGR_KEY_OTHER);
+}
+
+static void crossMgrParseValue(boolean is_string) {
+//stores the scalar value in the token buffer in _crossmgr_frame, if it is one we use
+	CrossMgrParser * p = &_crossmgr_parser;
+	CrossMgrFrame * frame = &_crossmgr_frame;
+	if (p->token_overflow) {
+		return;
+	}
+	p->token[p->token_length] = '\0';
+	const char * t = p->token;
+	const char * end = t + p->token_length;
+	boolean truth = (*t == 't' || (isDigit(*t) && *t != '0'));  //how ArduinoJson converts to a boolean
+	if (p->depth == 1 && !(p->arrays & (1 << 1))) {  //member of the top-level object
+		if (is_string) {
+			switch (p->key) {
+				case CROSSMGR_KEY_TNOW:
+					crossMgrCopyString(frame->tNow, sizeof(frame->tNow), t, end);
+					break;
+				#ifdef ENABLE_SPRINT_EXTENSIONS
+				case CROSSMGR_KEY_SPEED_UNIT:
+					crossMgrCopyString(frame->speed_unit, sizeof(frame->speed_unit), t, end);
+					frame->have_speed_unit = true;
+					break;
+				#endif
+			}
+			return;
+		}
+		switch (p->key) {
+			case CROSSMGR_KEY_CUR_RACE_TIME:
+				frame->have_race_time = crossMgrParseMillis(t, end, &frame->cur_race_ms);
+				break;
+			case CROSSMGR_KEY_LAP_ELAPSED_CLOCK:
+				frame->lap_elapsed_clock = truth;
+				break;
+			#ifdef ENABLE_SPRINT_EXTENSIONS
+			case CROSSMGR_KEY_SPRINT_TIME:
+				frame->sprint_time = isDigit(*t) || *t == '-' ? strtod(t, nullptr) : 0;
+				break;
+			case CROSSMGR_KEY_SPRINT_SPEED:
+				frame->sprint_speed = isDigit(*t) || *t == '-' ? strtod(t, nullptr) : 0;
+				break;
+			case CROSSMGR_KEY_SPRINT_BIB:
+				frame->sprint_bib = isDigit(*t) || *t == '-' ? (int)strtod(t, nullptr) : 0;
+				break;
+			case CROSSMGR_KEY_SPRINT_START:
+				frame->sprint_start = isDigit(*t) || *t == '-' ? (time_t)strtod(t, nullptr) : 0;
+				break;
+			case CROSSMGR_KEY_SPRINT_TIMEOUT:
+				frame->sprint_timeout = isDigit(*t) || *t == '-' ? (int)strtod(t, nullptr) : 0;
+				break;
+			case CROSSMGR_KEY_TIME_ECHO:
+				{
+					long seq = 0;
+					crossMgrParseDecimal(t, end, &seq, 0);
+					frame->have_time_echo = true;
+					frame->time_echo = seq;
+				}
+				break;
+			#endif
+		}
+	} else if (p->depth == 2 && (p->arrays & (1 << 2)) && p->index[2] < NUM_LAPCOUNTERS) {  //element of a top-level array
+		int i = p->index[2];
+		if (!is_string || !frame->want_colours) {
+			return;
+		}
+		if (p->key == CROSSMGR_KEY_FOREGROUNDS) {
+			frame->fg_colour[i] = crossMgrParseColour(t);
+			frame->have_fg |= 1 << i;
+		} else if (p->key == CROSSMGR_KEY_BACKGROUNDS) {
+			frame->bg_colour[i] = crossMgrParseColour(t);
+			frame->have_bg |= 1 << i;
+		}
+	} else if (p->depth == 3 && p->key == CROSSMGR_KEY_LABELS && (p->arrays & (1 << 2)) && (p->arrays & (1 << 3)) && p->index[2] < NUM_LAPCOUNTERS && !is_string) {
+		//labels has an entry per lap counter of the form [laps, flash, lap start time, ...]
+		int i = p->index[2];
+		switch (p->index[3]) {
+			case 0:
+				{
+					long laps = 0;
+					crossMgrParseDecimal(t, end, &laps, 0);
+					frame->laps[i] = laps;
+				}
+				break;
+			case 1:
+				frame->flash[i] = truth;
+				break;
+			case 2:
+				crossMgrParseMillis(t, end, &frame->lap_start[i]);
+				break;
+		}
+	}
+}
+
+static void crossMgrParseOpen(boolean array) {
+	CrossMgrParser * p = &_crossmgr_parser;
+	if (p->depth >= CROSSMGR_MAX_DEPTH) {
+		p->state = CROSSMGR_JSON_ERROR;
+		return;
+	}
+	p->depth++;
+	if (array) {
+		p->arrays |= 1UL << p->depth;
+	} else {
+		p->arrays &= ~(1UL << p->depth);
+	}
+	if (p->depth < 4) {
+		p->index[p->depth] = 0;
+	}
+	p->state = array ? CROSSMGR_JSON_VALUE : CROSSMGR_JSON_KEY;
+}
+
+static void crossMgrParseClose(boolean array) {
+	CrossMgrParser * p = &_crossmgr_parser;
+	if (p->depth == 0 || array != ((p->arrays & (1UL << p->depth)) != 0)) {  //mismatched bracket
+		p->state = CROSSMGR_JSON_ERROR;
+		return;
+	}
+	p->depth--;
+	p->state = p->depth == 0 ? CROSSMGR_JSON_END : CROSSMGR_JSON_AFTER;
+}
+
+static void crossMgrParse(const uint8_t * data, size_t length) {
+//parses the next part of the message
+	CrossMgrParser * p = &_crossmgr_parser;
+	unsigned long start = micros();
+	_crossmgr_bytes_decoded += length;
+	#ifdef DEBUG_JSON
+	char buf[65];
+	for (size_t i = 0; i < length; i += sizeof(buf) - 1) {
+		size_t n = min(length - i, sizeof(buf) - 1);
+		memcpy(buf, &data[i], n);
+		buf[n] = '\0';
+		crossMgrDebug(buf);
+	}
+	#endif
+	for (size_t i = 0; i < length && p->state != CROSSMGR_JSON_ERROR; i++) {
+		char c = data[i];
+		p->offset++;
+		if (p->state == CROSSMGR_JSON_STRING) {
+			if (p->unicode > 0) {  //skip the hex digits of a \u escape
+				p->unicode--;
+			} else if (p->escape) {
+				p->escape = false;
+				switch (c) {
+					case 'b': c = '\b'; break;
+					case 'f': c = '\f'; break;
+					case 'n': c = '\n'; break;
+					case 'r': c = '\r'; break;
+					case 't': c = '\t'; break;
+					case 'u': c = '?'; p->unicode = 4; break;  //we don't need anything outside ASCII
+				}
+				crossMgrParseToken(c);
+			} else if (c == '\\') {
+				p->escape = true;
+			} else if (c == '"') {
+				if (p->key_string) {
+					if (p->depth == 1) {  //only top-level keys matter
+						p->token[p->token_length] = '\0';
+						p->key = p->token_overflow ? CROSSMGR_KEY_OTHER : crossMgrParseKey(p->token);
+					}
+					p->state = CROSSMGR_JSON_COLON;
+				} else {
+					crossMgrParseValue(true);
+					p->state = CROSSMGR_JSON_AFTER;
+				}
+			} else {
+				crossMgrParseToken(c);
+			}
+			continue;
+		}
+		if (p->state == CROSSMGR_JSON_LITERAL) {
+			if (c != ',' && c != ']' && c != '}' && c != ' ' && c != '\t' && c != '\r' && c != '\n') {
+				crossMgrParseToken(c);
+				continue;
+			}
+			crossMgrParseValue(false);  //the end of a number, true, false or null, then look at c below
+			p->state = p->depth == 0 ? CROSSMGR_JSON_END : CROSSMGR_JSON_AFTER;
+		}
+		if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+			continue;
+		}
+		switch (p->state) {
+			case CROSSMGR_JSON_VALUE:
+				if (c == '{' || c == '[') {
+					crossMgrParseOpen(c == '[');
+				} else if (c == ']') {  //empty array
+					crossMgrParseClose(true);
+				} else if (c == '"' || c == '-' || isDigit(c) || c == 't' || c == 'f' || c == 'n') {
+					p->token_length = 0;
+					p->token_overflow = false;
+					if (c == '"') {
+						p->key_string = false;
+						p->state = CROSSMGR_JSON_STRING;
+					} else {
+						crossMgrParseToken(c);
+						p->state = CROSSMGR_JSON_LITERAL;
+					}
+				} else {
+					p->state = CROSSMGR_JSON_ERROR;
+				}
+				break;
+			case CROSSMGR_JSON_KEY:
+				if (c == '"') {
+					p->token_length = 0;
+					p->token_overflow = false;
+					p->key_string = true;
+					p->state = CROSSMGR_JSON_STRING;
+				} else if (c == '}') {  //empty object
+					crossMgrParseClose(false);
+				} else {
+					p->state = CROSSMGR_JSON_ERROR;
+				}
+				break;
+			case CROSSMGR_JSON_COLON:
+				p->state = (c == ':') ? CROSSMGR_JSON_VALUE : CROSSMGR_JSON_ERROR;
+				break;
+			case CROSSMGR_JSON_AFTER:
+				if (c == ',') {
+					if (p->arrays & (1UL << p->depth)) {
+						if (p->depth < 4) {
+							p->index[p->depth]++;
+						}
+						p->state = CROSSMGR_JSON_VALUE;
+					} else {
+						p->state = CROSSMGR_JSON_KEY;
+					}
+				} else if (c == ']' || c == '}') {
+					crossMgrParseClose(c == ']');
+				} else {
+					p->state = CROSSMGR_JSON_ERROR;
+				}
+				break;
+			default:  //anything after the end
+				p->state = CROSSMGR_JSON_ERROR;
+				break;
+		}
+	}
+	_crossmgr_parse_us += micros() - start;
+}
+
+static boolean crossMgrParseEnd() {
+//returns true if the message was a complete JSON object
+	CrossMgrParser * p = &_crossmgr_parser;
+	if (p->state == CROSSMGR_JSON_LITERAL && p->depth == 0) {  //a bare number, which isn't ours but is valid
+		crossMgrParseValue(false);
+		p->state = CROSSMGR_JSON_END;
+	}
+	if (p->state != CROSSMGR_JSON_END) {
+		char buf[80];
+		snprintf_P(buf, sizeof(buf), PSTR("[Err] Invalid or incomplete JSON at byte %lu, ignoring frame.\r\n"), (unsigned long)p->offset);
+		crossMgrDebug(buf);
+		return(false);
+	}
+	return(true);
+}
+
+static boolean crossMgrParseMillis(const char * p, const char * end, long * ms) {
+//parses a JSON number of seconds into integer milliseconds
+	return(crossMgrParseDecimal(p, end, ms, 3));
+}
+
+static void crossMgrCopyString(char * dest, size_t size, const char * p, const char * end) {
+//copies the string between p and end into dest, cut short if it won't fit
+	size_t length = end - p;
+	if (length > size - 1) {
+		length = size - 1;
+	}
+	memcpy(dest, p, length);
+	dest[length] = '\0';
+}
+
+static boolean crossMgrParseDecimal(const char * p, const char * end, long * value, int decimals) {
+/* Parses a JSON number, such as "1234.5678" or "1.2e3", into an integer number of 10^-decimals units.
+ * The result is rounded half away from zero on the decimal digits, so there is no binary
+ * floating point error (12.345 seconds gives 12345 ms, where (long)(12.345 * 1000.0) gives 12344).
+ * Returns false if p does not point at a number, or the result doesn't fit in a long
+ * (32 bits on the ESP8266 and ESP32, so about 24 days in milliseconds).
+ */
+	boolean negative = false;
+	if (p < end && *p == '-') {
+		negative = true;
+		p++;
+	}
+	if (p >= end || !isDigit(*p)) {
+		return false;
+	}
+	//collect enough significant digits for milliseconds plus a rounding digit
+	char digits[16];
+	int num_digits = 0;
+	int point = 0;  //position of the decimal point relative to the first significant digit
+	boolean leading = true;
+	while (p < end && isDigit(*p)) {
+		if (!(leading && *p == '0')) {  //drop leading zeros so they don't use up digits
+			leading = false;
+			if (num_digits < (int)sizeof(digits)) {
+				digits[num_digits++] = *p;
+			}
+			point++;
+		}
+		p++;
+	}
+	if (p < end && *p == '.') {
+		p++;
+		while (p < end && isDigit(*p)) {
+			if (leading && *p == '0') {
+				point--;  //zeros straight after the point move the significant digits right
+			} else {
+				leading = false;
+				if (num_digits < (int)sizeof(digits)) {
+					digits[num_digits++] = *p;
+				}
+			}
+			p++;
+		}
+	}
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		p++;
+		boolean negative_exponent = false;
+		if (p < end && (*p == '-' || *p == '+')) {
+			negative_exponent = (*p == '-');
+			p++;
+		}
+		int exponent = 0;
+		while (p < end && isDigit(*p)) {
+			if (exponent < 1000) {
+				exponent = exponent * 10 + (*p - '0');
+			}
+			p++;
+		}
+		point += negative_exponent ? -exponent : exponent;
+	}
+	//the result is the first (point + decimals) digits, the next digit rounds it
+	int wanted = point + decimals;
+	if (wanted > 18) {  //won't fit in the 64 bit accumulator, let alone a long
+		return false;
+	}
+	int64_t result = 0;
+	for (int i = 0; i < wanted; i++) {
+		result = result * 10 + (i < num_digits ? digits[i] - '0' : 0);
+	}
+	if (wanted >= 0 && wanted < num_digits && digits[wanted] >= '5') {
+		result++;
+	}
+	if (result > LONG_MAX) {
+		return false;
+	}
+	*value = negative ? -(long)result : (long)result;
+	return true;
+}
+
 CRGB crossMgrParseColour(const char* colour_string) {
 //parse string of the form "rgb(21, 1, 117)"
 char c[4];
@@ -761,3 +1709,815 @@ boolean crossMgrColoursAreDefault(int group, CRGB fg_colour, CRGB bg_colour) {
 	}
 	return(false);
 }
+
+#ifdef ENABLE_CHECKPOINT
+boolean crossMgrEnableCheckpoint(unsigned long interval) {
+//call after crossMgrSetup(), restores the last checkpoint and saves a new one at most every interval milliseconds
+	if (!LittleFS.begin()) {
+		crossMgrDebug(F("[Err] Could not mount LittleFS, checkpoint disabled!\r\n"));
+		return(false);
+	}
+	_crossmgr_checkpoint_enabled = true;
+	_crossmgr_checkpoint_interval = interval;
+	_crossmgr_last_checkpoint = millis();
+	return(crossMgrRestoreCheckpoint());
+}
+
+boolean crossMgrProvisional() {
+	return(_crossmgr_provisional);
+}
+
+static uint32_t crossMgrCRC32(const uint8_t * data, size_t length) {
+	uint32_t crc = 0xFFFFFFFF;
+	for (size_t i = 0; i < length; i++) {
+		crc ^= data[i];
+		for (int b = 0; b < 8; b++) {
+			crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+		}
+	}
+	return(~crc);
+}
+
+void crossMgrSaveCheckpoint() {
+//writes the current state to flash, but only if it has changed since the last write
+	if (!_crossmgr_checkpoint_enabled) {
+		return;
+	}
+	CrossMgrCheckpoint c;
+	memset(&c, 0, sizeof(c));  //so padding compares equal
+	c.magic = CROSSMGR_CHECKPOINT_MAGIC;
+	c.version = CROSSMGR_CHECKPOINT_VERSION;
+	c.size = sizeof(c);
+	c.race_in_progress = _crossmgr_race_in_progress;
+	c.lap_elapsed_clock = _crossmgr_lap_elapsed_clock;
+	for (int i = 0; i < NUM_LAPCOUNTERS; i++) {
+		c.laps[i] = _crossmgr_laps[i];
+		c.lap_start_times[i] = _crossmgr_lap_start_times[i];
+		if (_crossmgr_flash_laps[i]) {
+			c.flash_laps |= 1 << i;
+		}
+		c.fg_colour[i][0] = _crossmgr_fg_colour[i].red;
+		c.fg_colour[i][1] = _crossmgr_fg_colour[i].green;
+		c.fg_colour[i][2] = _crossmgr_fg_colour[i].blue;
+		c.bg_colour[i][0] = _crossmgr_bg_colour[i].red;
+		c.bg_colour[i][1] = _crossmgr_bg_colour[i].green;
+		c.bg_colour[i][2] = _crossmgr_bg_colour[i].blue;
+	}
+	int64_t wall = crossMgrWallTimeMillis();
+	if (_crossmgr_race_in_progress) {
+		c.race_elapsed = crossMgrRaceElapsed();
+		if (wall != 0) {
+			c.race_start_wall = wall - c.race_elapsed;
+		}
+	}
+	#ifdef ENABLE_SPRINT_EXTENSIONS
+	c.sprint_time = _crossmgr_sprint_time;
+	c.sprint_speed = _crossmgr_sprint_speed;
+	c.sprint_bib = _crossmgr_sprint_bib;
+	c.sprint_timeout = _crossmgr_sprint_timeout;
+	c.sprint_start_time = _crossmgr_sprint_start_time;
+	memcpy(c.sprint_unit, _crossmgr_sprint_unit, sizeof(c.sprint_unit));
+	#endif
+	//the race clock fields move on by themselves, so they don't count as a change unless the start time has jumped
+	if (_crossmgr_checkpoint.magic == CROSSMGR_CHECKPOINT_MAGIC) {
+		int64_t drift = c.race_start_wall - _crossmgr_checkpoint.race_start_wall;
+		if (drift > -MAX_RACE_START_TIME_DELTA && drift < MAX_RACE_START_TIME_DELTA) {
+			c.race_start_wall = _crossmgr_checkpoint.race_start_wall;
+		}
+		uint32_t race_elapsed = c.race_elapsed;
+		c.race_elapsed = _crossmgr_checkpoint.race_elapsed;
+		c.written_wall = _crossmgr_checkpoint.written_wall;
+		c.sequence = _crossmgr_checkpoint.sequence;
+		c.crc = _crossmgr_checkpoint.crc;
+		if (memcmp(&c, &_crossmgr_checkpoint, sizeof(c)) == 0) {
+			return;  //nothing to write
+		}
+		c.race_elapsed = race_elapsed;
+	}
+	c.sequence = _crossmgr_checkpoint.sequence + 1;
+	c.written_wall = wall;
+	c.crc = crossMgrCRC32((const uint8_t *)&c, offsetof(CrossMgrCheckpoint, crc));
+	File f = LittleFS.open(CROSSMGR_CHECKPOINT_FILE, "w");
+	if (!f) {
+		crossMgrDebug(F("[Err] Could not open checkpoint file for writing!\r\n"));
+		return;
+	}
+	if (f.write((const uint8_t *)&c, sizeof(c)) != sizeof(c)) {
+		crossMgrDebug(F("[Err] Could not write checkpoint!\r\n"));
+	}
+	f.close();
+	_crossmgr_checkpoint = c;
+	#ifdef DEBUG
+	char buf[100];
+	snprintf_P(buf, sizeof(buf), PSTR("[CMr] Wrote checkpoint %u\r\n"), c.sequence);
+	crossMgrDebug(buf);
+	#endif
+}
+
+boolean crossMgrRestoreCheckpoint() {
+//restores the state saved by crossMgrSaveCheckpoint(), marked provisional until live data arrives
+	File f = LittleFS.open(CROSSMGR_CHECKPOINT_FILE, "r");
+	if (!f) {
+		return(false);
+	}
+	CrossMgrCheckpoint c;
+	size_t length = f.read((uint8_t *)&c, sizeof(c));
+	f.close();
+	if (length != sizeof(c) || c.magic != CROSSMGR_CHECKPOINT_MAGIC || c.version != CROSSMGR_CHECKPOINT_VERSION || c.size != sizeof(c)
+		|| c.crc != crossMgrCRC32((const uint8_t *)&c, offsetof(CrossMgrCheckpoint, crc))) {
+		crossMgrDebug(F("[Err] Checkpoint is invalid, ignoring.\r\n"));
+		return(false);
+	}
+	_crossmgr_checkpoint = c;  //so an unchanged state isn't written again
+	int64_t wall = crossMgrWallTimeMillis();
+	if (wall != 0 && c.written_wall != 0 && wall - c.written_wall > CROSSMGR_CHECKPOINT_MAX_AGE) {
+		crossMgrDebug(F("[CMr] Checkpoint is too old, ignoring.\r\n"));
+		return(false);
+	}
+	_crossmgr_lap_elapsed_clock = c.lap_elapsed_clock;
+	for (int i = 0; i < NUM_LAPCOUNTERS; i++) {
+		_crossmgr_laps[i] = c.laps[i];
+		_crossmgr_lap_start_times[i] = c.lap_start_times[i];
+		_crossmgr_flash_laps[i] = c.flash_laps & (1 << i);
+		_crossmgr_fg_colour[i] = CRGB(c.fg_colour[i][0], c.fg_colour[i][1], c.fg_colour[i][2]);
+		_crossmgr_bg_colour[i] = CRGB(c.bg_colour[i][0], c.bg_colour[i][1], c.bg_colour[i][2]);
+	}
+	_crossmgr_race_in_progress = c.race_in_progress;
+	if (_crossmgr_race_in_progress) {
+		//if we know the wall time we can allow for however long we were off, otherwise carry on from when it was written
+		unsigned long elapsed = c.race_elapsed;
+		if (wall != 0 && c.race_start_wall != 0) {
+			elapsed = wall - c.race_start_wall;
+		}
+		_crossmgr_race_start = millis() - elapsed;
+		_crossmgr_last_got_race_time = millis();
+	}
+	#ifdef ENABLE_SPRINT_EXTENSIONS
+	if (wall != 0 && c.written_wall != 0) {  //a sprint result is only shown again if we can tell how old it is
+		_crossmgr_sprint_time = c.sprint_time;
+		_crossmgr_sprint_speed = c.sprint_speed;
+		_crossmgr_sprint_bib = c.sprint_bib;
+		_crossmgr_sprint_timeout = c.sprint_timeout;
+		_crossmgr_sprint_start_time = c.sprint_start_time;
+		memcpy(_crossmgr_sprint_unit, c.sprint_unit, sizeof(_crossmgr_sprint_unit));
+		_crossmgr_sprint_unit[sizeof(_crossmgr_sprint_unit) - 1] = '\0';
+		if (_crossmgr_sprint_time > 0) {
+			_crossmgr_last_got_sprint_data = millis() - (unsigned long)(wall - c.written_wall);  //at least this old
+		}
+	}
+	#endif
+	//none of it counts until live data confirms it
+	_crossmgr_provisional = true;
+	_crossmgr_restored_at = millis();
+	#ifdef DEBUG
+	char buf[100];
+	snprintf_P(buf, sizeof(buf), PSTR("[CMr] Restored checkpoint %u, race in progress: %u\r\n"), c.sequence, c.race_in_progress);
+	crossMgrDebug(buf);
+	#endif
+	//let the application draw it straight away
+	for (int i = 0; i < NUM_LAPCOUNTERS; i++) {
+		crossMgrOnGotColours(i);
+	}
+	crossMgrOnGotRaceData(millis());
+	return(true);
+}
+
+#ifdef ENABLE_SPRINT_EXTENSIONS
+static void crossMgrDiscardRestoredSprint() {
+//forgets a sprint result restored from the checkpoint that live data hasn't confirmed
+	if (_crossmgr_sprint_time <= 0) {
+		return;  //nothing was restored
+	}
+	_crossmgr_sprint_time = -1;
+	_crossmgr_sprint_speed = -1;
+	_crossmgr_sprint_bib = -1;
+	_crossmgr_sprint_timeout = -1;
+	_crossmgr_sprint_start_time = 0;
+	_crossmgr_last_got_sprint_data = millis() - RACE_TIMEOUT;
+	crossMgrOnGotSprintData(millis());
+}
+#endif
+#endif
+
+#ifdef ENABLE_LATENCY_TRACE
+static long crossMgrParseTimeOfDay(const char * tNow) {
+//returns the time part of a tNow string ("2023-10-04 12:34:56.789") as milliseconds since midnight, or -1
+	if (tNow == nullptr || strlen(tNow) < 23) {
+		return(-1);
+	}
+	for (int i = 11; i < 23; i++) {
+		if (i != 13 && i != 16 && i != 19 && !isDigit(tNow[i])) {
+			return(-1);
+		}
+	}
+	long h = (tNow[11] - '0') * 10 + (tNow[12] - '0');
+	long m = (tNow[14] - '0') * 10 + (tNow[15] - '0');
+	long s = (tNow[17] - '0') * 10 + (tNow[18] - '0');
+	long ms = (tNow[20] - '0') * 100 + (tNow[21] - '0') * 10 + (tNow[22] - '0');
+	return(((h * 60 + m) * 60 + s) * 1000 + ms);
+}
+
+static void crossMgrTraceAdd(CrossMgrTraceStage stage, unsigned long us) {
+//histogram with two buckets per power of two, so percentiles are within 25%
+	uint32_t v = us;
+	int bucket;
+	if (v < 2) {
+		bucket = v;
+	} else {
+		int octave = 31 - __builtin_clz(v);
+		bucket = octave * 2 + ((v >> (octave - 1)) & 1);
+	}
+	if (bucket >= CROSSMGR_TRACE_BUCKETS) {
+		bucket = CROSSMGR_TRACE_BUCKETS - 1;
+	}
+	uint16_t * h = _crossmgr_trace_histogram[stage];
+	if (h[bucket] == 0xFFFF) {  //halve everything rather than overflow, keeping the shape
+		for (int i = 0; i < CROSSMGR_TRACE_BUCKETS; i++) {
+			h[i] >>= 1;
+		}
+	}
+	h[bucket]++;
+}
+
+static void crossMgrTraceFinish() {
+//adds the open record to the histograms
+	if (!_crossmgr_trace_open) {
+		return;
+	}
+	_crossmgr_trace_open = false;
+	const CrossMgrTrace * t = &_crossmgr_traces[_crossmgr_trace_head];
+	unsigned long wire = 0;
+	if (t->have_wire) {
+		long wire_ms = t->wire;
+		if (wire_ms < 0) {
+			wire_ms = 0;
+		} else if (wire_ms > CROSSMGR_TRACE_MAX_WIRE) {  //clamped before scaling, so it can't overflow
+			wire_ms = CROSSMGR_TRACE_MAX_WIRE;
+		}
+		wire = wire_ms * 1000;
+		crossMgrTraceAdd(CROSSMGR_TRACE_WIRE, wire);
+	}
+	crossMgrTraceAdd(CROSSMGR_TRACE_PARSE, t->parsed - t->received);
+	crossMgrTraceAdd(CROSSMGR_TRACE_DISPATCH, t->dispatched - t->parsed);
+	unsigned long drawn = t->dispatched;
+	if (t->rendered) {
+		//if the application rendered from within a callback this stage is part of dispatch
+		if ((long)(t->rendered - t->dispatched) > 0) {
+			crossMgrTraceAdd(CROSSMGR_TRACE_RENDER, t->rendered - t->dispatched);
+			drawn = t->rendered;
+		} else {
+			crossMgrTraceAdd(CROSSMGR_TRACE_RENDER, 0);
+		}
+	}
+	if (t->shown) {
+		crossMgrTraceAdd(CROSSMGR_TRACE_SHOW, (long)(t->shown - drawn) > 0 ? t->shown - drawn : 0);
+		crossMgrTraceAdd(CROSSMGR_TRACE_TOTAL, wire + (t->shown - t->received));
+	}
+}
+
+static void crossMgrTraceBegin(unsigned long received, unsigned long parsed, long crossmgr_time, unsigned int groups) {
+//starts a record for a frame that changed the race state; the previous one is finished even if it was never shown
+	crossMgrTraceFinish();
+	_crossmgr_trace_head = (_crossmgr_trace_head + 1) % CROSSMGR_TRACE_HISTORY;
+	CrossMgrTrace * t = &_crossmgr_traces[_crossmgr_trace_head];
+	t->sequence = ++_crossmgr_trace_sequence;
+	t->groups = groups;
+	t->crossmgr_time = crossmgr_time;
+	t->received = received;
+	t->parsed = parsed;
+	t->dispatched = parsed;
+	t->rendered = 0;
+	t->shown = 0;
+	t->have_wire = false;
+	if (crossmgr_time >= 0 && _crossmgr_last_clock_set != 0) {
+		//our copy of CrossMgr's clock when the frame arrived, so this is relative to the delay of the frame it was last synced from
+		long arrived = (crossMgrWallTimeMillis() - (micros() - received) / 1000) % 86400000;
+		long wire = arrived - crossmgr_time;
+		if (wire > 43200000) {  //either side of midnight
+			wire -= 86400000;
+		} else if (wire < -43200000) {
+			wire += 86400000;
+		}
+		t->wire = wire;
+		t->have_wire = true;
+	}
+	_crossmgr_trace_open = true;
+}
+
+static void crossMgrTraceDispatched() {
+	if (_crossmgr_trace_open) {
+		_crossmgr_traces[_crossmgr_trace_head].dispatched = micros();
+	}
+}
+
+void crossMgrTraceRendered() {
+//the application calls this when it has drawn the new state into its frame buffer
+	if (_crossmgr_trace_open && _crossmgr_traces[_crossmgr_trace_head].rendered == 0) {
+		_crossmgr_traces[_crossmgr_trace_head].rendered = micros();
+	}
+}
+
+void crossMgrTraceShown() {
+//the application calls this when the new state has been sent to the LEDs (eg. after FastLED.show())
+	if (_crossmgr_trace_open) {
+		_crossmgr_traces[_crossmgr_trace_head].shown = micros();
+		crossMgrTraceFinish();
+	}
+}
+
+const CrossMgrTrace * crossMgrGetTrace(int n) {
+//returns the nth most recent record, 0 being the latest, or nullptr
+	if (_crossmgr_trace_head < 0 || n < 0 || n >= CROSSMGR_TRACE_HISTORY || (uint32_t)n >= _crossmgr_trace_sequence) {
+		return(nullptr);
+	}
+	return(&_crossmgr_traces[(_crossmgr_trace_head + CROSSMGR_TRACE_HISTORY - n) % CROSSMGR_TRACE_HISTORY]);
+}
+
+unsigned long crossMgrTracePercentile(CrossMgrTraceStage stage, int percent) {
+//returns the upper bound of the histogram bucket containing the given percentile, in microseconds
+	const uint16_t * h = _crossmgr_trace_histogram[stage];
+	uint32_t total = 0;
+	for (int i = 0; i < CROSSMGR_TRACE_BUCKETS; i++) {
+		total += h[i];
+	}
+	if (total == 0) {
+		return(0);
+	}
+	uint32_t wanted = (total * percent + 99) / 100;
+	uint32_t count = 0;
+	int bucket = 0;
+	for (; bucket < CROSSMGR_TRACE_BUCKETS - 1; bucket++) {
+		count += h[bucket];
+		if (count >= wanted) {
+			break;
+		}
+	}
+	if (bucket < 2) {
+		return(bucket);
+	}
+	int octave = bucket / 2;
+	unsigned long lower = (1UL << octave) + (bucket % 2) * (1UL << (octave - 1));
+	return(lower + (1UL << (octave - 1)) - 1);
+}
+
+void crossMgrTraceReport() {
+//prints the 50th, 90th and 99th percentile of each stage to the debug output
+	static const char * const names[CROSSMGR_TRACE_STAGES] = { "wire", "parse", "dispatch", "render", "show", "total" };
+	char buf[100];
+	for (int i = 0; i < CROSSMGR_TRACE_STAGES; i++) {
+		snprintf_P(buf, sizeof(buf), PSTR("[CMr] Latency %s: p50 %lu us, p90 %lu us, p99 %lu us\r\n"), names[i],
+			crossMgrTracePercentile((CrossMgrTraceStage)i, 50), crossMgrTracePercentile((CrossMgrTraceStage)i, 90), crossMgrTracePercentile((CrossMgrTraceStage)i, 99));
+		crossMgrDebug(buf);
+	}
+}
+
+void crossMgrTraceReset() {
+	memset(_crossmgr_trace_histogram, 0, sizeof(_crossmgr_trace_histogram));
+}
+#endif
+
+boolean crossMgrDeflateActive() {
+	#ifdef ENABLE_DEFLATE
+	return(_crossmgr_deflate_active);
+	#else
+	return(false);
+	#endif
+}
+
+unsigned long crossMgrFramesReceived() {
+	return(_crossmgr_frames_received);
+}
+
+unsigned long crossMgrBytesReceived() {
+	return(_crossmgr_bytes_received);
+}
+
+unsigned long crossMgrBytesDecoded() {
+	return(_crossmgr_bytes_decoded);
+}
+
+unsigned long crossMgrInflateMicros() {
+	return(_crossmgr_inflate_us);
+}
+
+unsigned long crossMgrParseMicros() {
+	return(_crossmgr_parse_us);
+}
+
+void crossMgrFrameStatsReport() {
+//prints the average message size before and after decompression, and the time taken to decompress and parse, to the debug output
+	if (_crossmgr_frames_received == 0) {
+		return;
+	}
+	char buf[120];
+	snprintf_P(buf, sizeof(buf), PSTR("[CMr] %lu messages, %lu bytes received, %lu bytes decoded, compression %s\r\n"),
+		(unsigned long)_crossmgr_frames_received, (unsigned long)_crossmgr_bytes_received, (unsigned long)_crossmgr_bytes_decoded,
+		crossMgrDeflateActive() ? "on" : "off");
+	crossMgrDebug(buf);
+	snprintf_P(buf, sizeof(buf), PSTR("[CMr] Per message: %lu bytes received, %lu us to inflate, %lu us to parse\r\n"),
+		(unsigned long)(_crossmgr_bytes_received / _crossmgr_frames_received), (unsigned long)(_crossmgr_inflate_us / _crossmgr_frames_received),
+		(unsigned long)(_crossmgr_parse_us / _crossmgr_frames_received));
+	crossMgrDebug(buf);
+}
+
+void crossMgrFrameStatsReset() {
+	_crossmgr_frames_received = 0;
+	_crossmgr_bytes_received = 0;
+	_crossmgr_bytes_decoded = 0;
+	_crossmgr_inflate_us = 0;
+	_crossmgr_parse_us = 0;
+}
+
+#ifdef ENABLE_DEFLATE
+static void crossMgrCheckDeflate() {
+//called on connection, to see whether the server accepted our offer of compression
+	const String & extensions = _crossmgr_webSocket.extensions();
+	_crossmgr_deflate_active = extensions.indexOf("permessage-deflate") >= 0;
+	crossMgrInflateReset(&_crossmgr_inflater);  //new connection, new compression context
+	if (_crossmgr_deflate_active) {
+		int window_bits = 15;  //the default if the server doesn't say
+		int i = extensions.indexOf("server_max_window_bits=");
+		if (i >= 0) {
+			window_bits = extensions.substring(i + 23).toInt();
+		}
+		#ifdef DEBUG
+		char buf[80];
+		snprintf_P(buf, sizeof(buf), PSTR("[CMr] permessage-deflate on, server window %d bits.\r\n"), window_bits);
+		crossMgrDebug(buf);
+		#endif
+		if (window_bits > CROSSMGR_INFLATE_WINDOW_BITS) {  //back references could reach past our window
+			crossMgrDebug(F("[Err] Server compression window is bigger than ours, reconnecting without compression.\r\n"));
+			crossMgrRefuseDeflate();
+		}
+	}
+}
+
+static void crossMgrOfferDeflate() {
+//sets the extra headers for the next connection, offering compression unless the server has let us down
+	char headers[120];
+	if (_crossmgr_deflate_refused) {
+		snprintf_P(headers, sizeof(headers), PSTR("Origin: file://"));  //WebSocketsClient's default
+	} else {
+		snprintf_P(headers, sizeof(headers), PSTR("Origin: file://\r\nSec-WebSocket-Extensions: permessage-deflate; server_max_window_bits=%d"), CROSSMGR_INFLATE_WINDOW_BITS);
+	}
+	_crossmgr_webSocket.setExtraHeaders(headers);
+}
+
+static void crossMgrRefuseDeflate() {
+//stops offering compression, and reconnects so that the server stops using it
+	_crossmgr_deflate_refused = true;
+	_crossmgr_deflate_active = false;
+	crossMgrOfferDeflate();
+	_crossmgr_webSocket.disconnect();
+}
+
+/* A small raw DEFLATE (RFC 1951) decoder for permessage-deflate, based on the approach of Mark Adler's puff.c
+ * Input can arrive in pieces of any size: each step of the decoder either completes or is undone and
+ * retried when more input arrives.  Output goes through a ring buffer of CROSSMGR_INFLATE_WINDOW bytes,
+ * which is the history that back references can reach, and from there to the sink in chunks.
+ * The window is kept between messages, because the server normally continues the same compression
+ * context from one message to the next.
+ */
+const uint16_t _crossmgr_length_base[29] PROGMEM = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+const uint8_t _crossmgr_length_extra[29] PROGMEM = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+const uint16_t _crossmgr_distance_base[30] PROGMEM = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073,
+	4097, 6145, 8193, 12289, 16385, 24577 };
+const uint8_t _crossmgr_distance_extra[30] PROGMEM = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+//order in which code length code lengths are sent
+const uint8_t _crossmgr_code_length_order[19] PROGMEM = {
+	16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+static uint32_t crossMgrInflateBits(CrossMgrInflater * s, int n) {
+//returns the next n bits, or sets starved if there isn't enough input
+	while (s->bit_count < n) {
+		if (s->in == s->in_end) {
+			s->starved = true;
+			return(0);
+		}
+		s->bits |= (uint32_t)(*s->in++) << s->bit_count;
+		s->bit_count += 8;
+	}
+	uint32_t value = s->bits & ((1UL << n) - 1);
+	s->bits >>= n;
+	s->bit_count -= n;
+	return(value);
+}
+
+static int crossMgrInflateBuild(uint16_t * count, uint16_t * symbol, const uint8_t * length, int n) {
+//builds a canonical Huffman decoding table from code lengths, returns -1 if the code is over-subscribed
+	uint16_t offsets[16];
+	for (int len = 0; len < 16; len++) {
+		count[len] = 0;
+	}
+	for (int sym = 0; sym < n; sym++) {
+		count[length[sym]]++;
+	}
+	int left = 1;
+	for (int len = 1; len < 16; len++) {
+		left <<= 1;
+		left -= count[len];
+		if (left < 0) {
+			return(-1);
+		}
+	}
+	offsets[1] = 0;
+	for (int len = 1; len < 15; len++) {
+		offsets[len + 1] = offsets[len] + count[len];
+	}
+	for (int sym = 0; sym < n; sym++) {
+		if (length[sym] != 0) {
+			symbol[offsets[length[sym]]++] = sym;
+		}
+	}
+	return(left);
+}
+
+static int crossMgrInflateDecode(CrossMgrInflater * s, const uint16_t * count, const uint16_t * symbol) {
+//decodes one symbol, returns -1 if starved or -2 if the code is invalid
+	int code = 0;
+	int first = 0;
+	int index = 0;
+	for (int len = 1; len < 16; len++) {
+		code |= crossMgrInflateBits(s, 1);
+		if (s->starved) {
+			return(-1);
+		}
+		int c = count[len];
+		if (code - c < first) {
+			return(symbol[index + (code - first)]);
+		}
+		index += c;
+		first += c;
+		first <<= 1;
+		code <<= 1;
+	}
+	return(-2);
+}
+
+static void crossMgrInflateFlush(CrossMgrInflater * s) {
+	if (s->window_pos > s->window_flushed && s->sink != 0) {
+		(*s->sink)(&s->window[s->window_flushed], s->window_pos - s->window_flushed);
+	}
+	s->window_flushed = s->window_pos;
+}
+
+static void crossMgrInflatePut(CrossMgrInflater * s, uint8_t b) {
+	s->window[s->window_pos++] = b;
+	if (s->window_filled < CROSSMGR_INFLATE_WINDOW) {
+		s->window_filled++;
+	}
+	if (s->window_pos == CROSSMGR_INFLATE_WINDOW) {  //pass it on before it wraps round and is overwritten
+		crossMgrInflateFlush(s);
+		s->window_pos = 0;
+		s->window_flushed = 0;
+	}
+}
+
+static void crossMgrInflateReset(CrossMgrInflater * s) {
+//forgets the history, for a new connection
+	s->state = CROSSMGR_INFLATE_HEADER;
+	s->bits = 0;
+	s->bit_count = 0;
+	s->window_pos = 0;
+	s->window_flushed = 0;
+	s->window_filled = 0;
+}
+
+static void crossMgrInflateStep(CrossMgrInflater * s) {
+//one step of the decoder; if it runs out of input it sets starved, and the caller undoes it
+	switch (s->state) {
+		case CROSSMGR_INFLATE_HEADER:
+			{
+				uint32_t header = crossMgrInflateBits(s, 3);
+				if (s->starved) {
+					return;
+				}
+				s->final_block = header & 1;
+				switch (header >> 1) {
+					case 0:
+						s->state = CROSSMGR_INFLATE_STORED_LENGTH;
+						break;
+					case 1:
+						//fixed Huffman codes
+						for (int i = 0; i < 288; i++) {
+							s->lengths[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+						}
+						crossMgrInflateBuild(s->length_count, s->length_symbol, s->lengths, 288);
+						for (int i = 0; i < 30; i++) {
+							s->lengths[i] = 5;
+						}
+						crossMgrInflateBuild(s->distance_count, s->distance_symbol, s->lengths, 30);
+						s->state = CROSSMGR_INFLATE_SYMBOL;
+						break;
+					case 2:
+						s->state = CROSSMGR_INFLATE_TABLE_SIZES;
+						break;
+					default:
+						s->state = CROSSMGR_INFLATE_ERROR;
+						break;
+				}
+			}
+			break;
+		case CROSSMGR_INFLATE_STORED_LENGTH:
+			{
+				//stored blocks start on a byte boundary
+				s->bits >>= s->bit_count & 7;
+				s->bit_count -= s->bit_count & 7;
+				uint32_t length = crossMgrInflateBits(s, 16);
+				uint32_t complement = crossMgrInflateBits(s, 16);
+				if (s->starved) {
+					return;
+				}
+				if (length != (~complement & 0xFFFF)) {
+					s->state = CROSSMGR_INFLATE_ERROR;
+				} else {
+					s->stored_remaining = length;
+					s->state = CROSSMGR_INFLATE_STORED;
+				}
+			}
+			break;
+		case CROSSMGR_INFLATE_STORED:
+			if (s->stored_remaining == 0) {
+				s->state = s->final_block ? CROSSMGR_INFLATE_DONE : CROSSMGR_INFLATE_HEADER;
+			} else {
+				uint8_t b = crossMgrInflateBits(s, 8);
+				if (s->starved) {
+					return;
+				}
+				crossMgrInflatePut(s, b);
+				s->stored_remaining--;
+			}
+			break;
+		case CROSSMGR_INFLATE_TABLE_SIZES:
+			{
+				int hlit = crossMgrInflateBits(s, 5) + 257;
+				int hdist = crossMgrInflateBits(s, 5) + 1;
+				int hclen = crossMgrInflateBits(s, 4) + 4;
+				if (s->starved) {
+					return;
+				}
+				if (hlit > 286 || hdist > 30) {
+					s->state = CROSSMGR_INFLATE_ERROR;
+					return;
+				}
+				s->hlit = hlit;
+				s->hdist = hdist;
+				s->hclen = hclen;
+				s->index = 0;
+				for (int i = 0; i < 19; i++) {
+					s->lengths[i] = 0;
+				}
+				s->state = CROSSMGR_INFLATE_CODE_LENGTHS;
+			}
+			break;
+		case CROSSMGR_INFLATE_CODE_LENGTHS:
+			{
+				uint8_t length = crossMgrInflateBits(s, 3);
+				if (s->starved) {
+					return;
+				}
+				s->lengths[pgm_read_byte(&_crossmgr_code_length_order[s->index++])] = length;
+				if (s->index == s->hclen) {
+					if (crossMgrInflateBuild(s->code_length_count, s->code_length_symbol, s->lengths, 19) != 0) {
+						s->state = CROSSMGR_INFLATE_ERROR;  //must be complete
+						return;
+					}
+					s->index = 0;
+					s->state = CROSSMGR_INFLATE_LENGTHS;
+				}
+			}
+			break;
+		case CROSSMGR_INFLATE_LENGTHS:
+			{
+				int sym = crossMgrInflateDecode(s, s->code_length_count, s->code_length_symbol);
+				if (sym == -1) {
+					return;
+				}
+				uint8_t length = 0;
+				int repeat = 1;
+				if (sym < 0) {
+					s->state = CROSSMGR_INFLATE_ERROR;
+					return;
+				} else if (sym < 16) {
+					length = sym;
+				} else if (sym == 16) {  //repeat the previous length
+					if (s->index == 0) {
+						s->state = CROSSMGR_INFLATE_ERROR;
+						return;
+					}
+					length = s->lengths[s->index - 1];
+					repeat = 3 + crossMgrInflateBits(s, 2);
+				} else if (sym == 17) {  //repeat zero
+					repeat = 3 + crossMgrInflateBits(s, 3);
+				} else {
+					repeat = 11 + crossMgrInflateBits(s, 7);
+				}
+				if (s->starved) {
+					return;
+				}
+				if (s->index + repeat > s->hlit + s->hdist) {
+					s->state = CROSSMGR_INFLATE_ERROR;
+					return;
+				}
+				while (repeat--) {
+					s->lengths[s->index++] = length;
+				}
+				if (s->index == s->hlit + s->hdist) {
+					if (s->lengths[256] == 0
+						|| crossMgrInflateBuild(s->length_count, s->length_symbol, s->lengths, s->hlit) < 0
+						|| crossMgrInflateBuild(s->distance_count, s->distance_symbol, s->lengths + s->hlit, s->hdist) < 0) {
+						s->state = CROSSMGR_INFLATE_ERROR;
+						return;
+					}
+					s->state = CROSSMGR_INFLATE_SYMBOL;
+				}
+			}
+			break;
+		case CROSSMGR_INFLATE_SYMBOL:
+			{
+				int sym = crossMgrInflateDecode(s, s->length_count, s->length_symbol);
+				if (sym == -1) {
+					return;
+				}
+				if (sym < 0 || sym > 285) {
+					s->state = CROSSMGR_INFLATE_ERROR;
+				} else if (sym < 256) {
+					crossMgrInflatePut(s, sym);
+				} else if (sym == 256) {
+					s->state = s->final_block ? CROSSMGR_INFLATE_DONE : CROSSMGR_INFLATE_HEADER;
+				} else {
+					sym -= 257;
+					int length = pgm_read_word(&_crossmgr_length_base[sym]) + crossMgrInflateBits(s, pgm_read_byte(&_crossmgr_length_extra[sym]));
+					if (s->starved) {
+						return;
+					}
+					s->copy_length = length;
+					s->state = CROSSMGR_INFLATE_DISTANCE;
+				}
+			}
+			break;
+		case CROSSMGR_INFLATE_DISTANCE:
+			{
+				int sym = crossMgrInflateDecode(s, s->distance_count, s->distance_symbol);
+				if (sym == -1) {
+					return;
+				}
+				if (sym < 0 || sym > 29) {
+					s->state = CROSSMGR_INFLATE_ERROR;
+					return;
+				}
+				unsigned int distance = pgm_read_word(&_crossmgr_distance_base[sym]) + crossMgrInflateBits(s, pgm_read_byte(&_crossmgr_distance_extra[sym]));
+				if (s->starved) {
+					return;
+				}
+				if (distance > s->window_filled) {  //further back than we have, the server's window is bigger than ours
+					s->state = CROSSMGR_INFLATE_ERROR;
+					return;
+				}
+				s->copy_distance = distance;
+				s->state = CROSSMGR_INFLATE_COPY;
+			}
+			break;
+		case CROSSMGR_INFLATE_COPY:
+			while (s->copy_length > 0) {
+				crossMgrInflatePut(s, s->window[(s->window_pos - s->copy_distance) & (CROSSMGR_INFLATE_WINDOW - 1)]);
+				s->copy_length--;
+			}
+			s->state = CROSSMGR_INFLATE_SYMBOL;
+			break;
+	}
+}
+
+static int crossMgrInflate(CrossMgrInflater * s, const uint8_t * in, size_t length) {
+/* Decodes as much of the input as possible, passing the output to the sink.
+ * Returns -1 if the data is invalid, otherwise 0; any partial step is kept until more input arrives.
+ */
+	s->in = in;
+	s->in_end = in + length;
+	while (s->state != CROSSMGR_INFLATE_DONE && s->state != CROSSMGR_INFLATE_ERROR) {
+		const uint8_t * saved_in = s->in;
+		uint32_t saved_bits = s->bits;
+		int saved_bit_count = s->bit_count;
+		s->starved = false;
+		crossMgrInflateStep(s);
+		if (s->starved) {
+			//undo the step, and keep the rest of the input as bits, as this buffer won't be here next time
+			//a step needs at most 28 bits, so what's left always fits
+			s->in = saved_in;
+			s->bits = saved_bits;
+			s->bit_count = saved_bit_count;
+			while (s->in < s->in_end) {
+				s->bits |= (uint32_t)(*s->in++) << s->bit_count;
+				s->bit_count += 8;
+			}
+			break;
+		}
+	}
+	crossMgrInflateFlush(s);
+	return(s->state == CROSSMGR_INFLATE_ERROR ? -1 : 0);
+}
+#endif
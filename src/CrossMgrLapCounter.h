@@ -1,13 +1,67 @@
 #ifndef CROSSMGR_LAP_COUNTER
 #define CROSSMGR_LAP_COUNTER
 #define ENABLE_SPRINT_EXTENSIONS  //extensions to the protocol used for displaying results from a sprint timer that pretends to be CrossMgr
+//#define ENABLE_CHECKPOINT  //support for saving the race state to flash, so it can be shown immediately after a reset
+//#define ENABLE_LATENCY_TRACE  //measure how long it takes from CrossMgr sending a frame to it appearing on the display
+//#define ENABLE_DEFLATE  //accept permessage-deflate compressed frames, if the server supports it
 #include <Arduino.h>
 #include <WebSocketsClient.h>   //connecting to CrossMgr https://github.com/Links2004/arduinoWebSockets
-#include <ArduinoJson.h>        //parsing JSON https://arduinojson.org/
 #include <FastLED.h>            //LED strip http://fastled.io/  (we use the CRGB struct)
 #if ! defined (ARDUINO_ARCH_ESP32)
 #include <TimeLib.h>            //general clockery https://github.com/PaulStoffregen/Time
 #endif
+#ifdef ENABLE_CHECKPOINT
+#include <LittleFS.h>           //flash filesystem, part of the ESP8266 and ESP32 cores
+#endif
+
+#define CROSSMGR_ALL_GROUPS -1  //group filter for subscribers that want every event regardless of group
+
+//events that can be subscribed to with crossMgrSubscribe()
+typedef enum {
+	CROSSMGR_EVENT_RACE_DATA,	//race data arrived (group is the lap counter that changed, or CROSSMGR_ALL_GROUPS)
+	CROSSMGR_EVENT_COLOURS,		//colours were parsed for a group
+	CROSSMGR_EVENT_SPRINT_DATA,	//sprint data arrived
+	CROSSMGR_EVENT_NETWORK,		//websocket activity, including disconnection
+	CROSSMGR_EVENT_DEBUG		//debugging output
+} CrossMgrEventType;
+
+//passed to subscribers; only the fields relevant to the event type are meaningful
+typedef struct {
+	CrossMgrEventType type;
+	int group;			//lap counter the event concerns, or CROSSMGR_ALL_GROUPS
+	unsigned long t;	//time relative to millis() that the data arrived
+	boolean connected;	//network state
+	const char * line;	//debugging output
+} CrossMgrEvent;
+
+typedef void (*CrossMgrEventHandler)(const CrossMgrEvent * event, void * context);
+
+#ifdef ENABLE_LATENCY_TRACE
+//stages of the path from CrossMgr to the LEDs, each is timed separately
+typedef enum {
+	CROSSMGR_TRACE_WIRE,		//CrossMgr's tNow to the frame arriving
+	CROSSMGR_TRACE_PARSE,		//frame arriving to parsing complete
+	CROSSMGR_TRACE_DISPATCH,	//parsing complete to callbacks returning
+	CROSSMGR_TRACE_RENDER,		//callbacks returning to crossMgrTraceRendered()
+	CROSSMGR_TRACE_SHOW,		//rendering complete to crossMgrTraceShown()
+	CROSSMGR_TRACE_TOTAL,		//tNow to crossMgrTraceShown(), or arrival if tNow or the clock is unknown
+	CROSSMGR_TRACE_STAGES
+} CrossMgrTraceStage;
+
+//one record per frame that changed the race state, times are micros() unless noted
+typedef struct {
+	uint32_t sequence;
+	unsigned int groups;		//bitmask of lap counters that changed
+	long crossmgr_time;			//tNow as milliseconds since midnight, -1 if not sent
+	boolean have_wire;			//wire is valid
+	long wire;					//milliseconds from tNow to arrival
+	unsigned long received;
+	unsigned long parsed;
+	unsigned long dispatched;
+	unsigned long rendered;		//0 if not reported
+	unsigned long shown;		//0 if not reported
+} CrossMgrTrace;
+#endif
 
 void crossMgrSetup(IPAddress ip, int reconnect_interval);
 
@@ -37,6 +91,8 @@ unsigned long crossMgrRaceStart();
 
 unsigned long crossMgrRaceElapsed();
 
+int64_t crossMgrWallTimeMillis();
+
 CRGB crossMgrGetFGColour(int group);
 
 CRGB crossMgrGetBGColour(int group);
@@ -58,6 +114,20 @@ int crossMgrSprintTimeout();
 
 unsigned long crossMgrSprintAge();
 
+void crossMgrSetTimeSyncInterval(unsigned long interval);
+
+long crossMgrTimeSyncRTT();
+
+long crossMgrTimeSyncMinRTT();
+
+long crossMgrTimeSyncMaxRTT();
+
+long crossMgrTimeSyncMeanRTT();
+
+unsigned long crossMgrTimeSyncCount();
+
+unsigned long crossMgrTimeSyncLost();
+
 void crossMgrSetOnGotSprintData(void (*fp)(const unsigned long t));
 
 void crossMgrOnGotSprintData(unsigned long t);
@@ -79,6 +149,12 @@ void crossMgrSetOnGotColours(void (*fp)(const int group));
 
 void crossMgrOnGotColours(int group);
 
+int crossMgrSubscribe(CrossMgrEventType type, CrossMgrEventHandler fp, void * context);
+
+int crossMgrSubscribe(CrossMgrEventType type, CrossMgrEventHandler fp, void * context, int group);
+
+void crossMgrUnsubscribe(int handle);
+
 void crossMgrDebug (const __FlashStringHelper * line);
 
 void crossMgrSetDebug(void (*fp)(const char * line));
@@ -93,4 +169,44 @@ CRGB crossMgrParseColour(const char* colour_string);
 
 boolean crossMgrColoursAreDefault(int group, CRGB fg_colour, CRGB bg_colour);
 
+#ifdef ENABLE_LATENCY_TRACE
+void crossMgrTraceRendered();
+
+void crossMgrTraceShown();
+
+const CrossMgrTrace * crossMgrGetTrace(int n);
+
+unsigned long crossMgrTracePercentile(CrossMgrTraceStage stage, int percent);
+
+void crossMgrTraceReport();
+
+void crossMgrTraceReset();
+#endif
+
+boolean crossMgrDeflateActive();
+
+unsigned long crossMgrFramesReceived();
+
+unsigned long crossMgrBytesReceived();
+
+unsigned long crossMgrBytesDecoded();
+
+unsigned long crossMgrInflateMicros();
+
+unsigned long crossMgrParseMicros();
+
+void crossMgrFrameStatsReport();
+
+void crossMgrFrameStatsReset();
+
+#ifdef ENABLE_CHECKPOINT
+boolean crossMgrEnableCheckpoint(unsigned long interval);
+
+boolean crossMgrProvisional();
+
+void crossMgrSaveCheckpoint();
+
+boolean crossMgrRestoreCheckpoint();
+#endif
+
 #endif